@@ -1,5 +1,12 @@
+#define _GNU_SOURCE // For struct ucred and sched_setaffinity().
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sched.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -11,6 +18,9 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "err.h"
 #include "common.h"
@@ -130,6 +140,56 @@ struct sockaddr_in6 get_server_address_ipv6(char const *host, uint16_t port) {
     return server_address;
 }
 
+struct sockaddr_un get_unix_address(char const *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fatal("Socket path too long: %s", path);
+    }
+    strcpy(address.sun_path, path);
+    return address;
+}
+
+// Writes the address of the socket, or of its peer, as "ip:port", or as
+// "unix:path" for Unix sockets. Unnamed Unix sockets are told apart by the pid
+// of their process. Returns false if the address can't be read.
+bool format_endpoint(int socket_fd, bool peer, char *out, size_t size) {
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    int ret = peer ? getpeername(socket_fd, (struct sockaddr *) &address, &length) :
+                     getsockname(socket_fd, (struct sockaddr *) &address, &length);
+    if (ret < 0) {
+        return false;
+    }
+
+    char ip[INET6_ADDRSTRLEN];
+    if (address.ss_family == AF_INET) {
+        struct sockaddr_in *address4 = (struct sockaddr_in *) &address;
+        inet_ntop(AF_INET, &address4->sin_addr, ip, sizeof(ip));
+        snprintf(out, size, "%s:%d", ip, ntohs(address4->sin_port));
+    } else if (address.ss_family == AF_INET6) {
+        struct sockaddr_in6 *address6 = (struct sockaddr_in6 *) &address;
+        inet_ntop(AF_INET6, &address6->sin6_addr, ip, sizeof(ip));
+        snprintf(out, size, "%s:%d", ip, ntohs(address6->sin6_port));
+    } else if (address.ss_family == AF_UNIX) {
+        struct sockaddr_un *address_un = (struct sockaddr_un *) &address;
+        if (length > offsetof(struct sockaddr_un, sun_path) && address_un->sun_path[0] != '\0') {
+            snprintf(out, size, "unix:%s", address_un->sun_path);
+            return true;
+        }
+        struct ucred cred = {.pid = getpid()};
+        socklen_t cred_length = sizeof(cred);
+        if (peer && getsockopt(socket_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length) < 0) {
+            return false;
+        }
+        snprintf(out, size, "unix:pid%d", (int) cred.pid);
+    } else {
+        snprintf(out, size, "?");
+    }
+    return true;
+}
+
 char *read_msg(int socket_fd) {
     char *msg = malloc((1 + BUF_SIZE) * sizeof(char));
     memset(msg, 0, (1 + BUF_SIZE) * sizeof(char));
@@ -139,10 +199,8 @@ char *read_msg(int socket_fd) {
     ptr++;
     do {
         read_length = readn(socket_fd, msg + ptr, 1);
-        if (read_length < 0) {
-            syserr("readn");
-        }
-        else if (read_length == 0) {
+        if (read_length <= 0) {
+            // Broken connection is treated like a closed one.
             free(msg);
             return NULL;
         }
@@ -189,6 +247,122 @@ ssize_t writen(int fd, const void *vptr, size_t n) {
     return n;
 }
 
+// Write all the buffers with as few system calls as possible.
+// The array is modified to track partially written buffers.
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    while (iovcnt > 0) {
+        ssize_t nwritten = writev(fd, iov, iovcnt);
+        if (nwritten <= 0)
+            return nwritten;  // error
+
+        total += nwritten;
+        while (iovcnt > 0 && (size_t) nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
+// Send a message with a descriptor attached (if fd isn't -1) over an
+// AF_UNIX socket.
+ssize_t send_with_fd(int socket_fd, void const *data, size_t len, int fd) {
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = len};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(socket_fd, &msg, MSG_NOSIGNAL);
+}
+
+// Receive a message sent by send_with_fd(). The descriptor is stored in fd,
+// -1 if none was attached.
+ssize_t recv_with_fd(int socket_fd, void *data, size_t size, int *fd) {
+    struct iovec iov = {.iov_base = data, .iov_len = size};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    *fd = -1;
+    ssize_t len = recvmsg(socket_fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0) {
+        return len;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return len;
+}
+
+// Function to make the socket answer fast at the cost of CPU: small messages
+// go out at once and blocking reads busy poll the device queue for up to
+// busy_poll_us microseconds. Both are best effort, Unix sockets have no
+// Nagle's algorithm and going above net.core.busy_read needs CAP_NET_ADMIN.
+void set_low_latency(int socket_fd, int busy_poll_us) {
+    int option = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    setsockopt(socket_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us));
+}
+
+// Function to run the calling process on the given CPU only.
+void pin_to_cpu(size_t cpu) {
+    if (cpu >= CPU_SETSIZE) {
+        fatal("%zu is not a valid CPU number", cpu);
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        syserr("sched_setaffinity %zu", cpu);
+    }
+}
+
+// Function to get the monotonic time in nanoseconds.
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Same as poll(), but for spin_ns nanoseconds the descriptors are checked
+// without going to sleep, so what comes soon is picked up without the
+// wakeup latency.
+int poll_spin(struct pollfd *fds, nfds_t nfds, int timeout, int64_t spin_ns) {
+    if (spin_ns > 0 && timeout != 0) {
+        int64_t spin_end = monotonic_ns() + spin_ns;
+        do {
+            int ret = poll(fds, nfds, 0);
+            if (ret != 0) {
+                return ret;
+            }
+        } while (monotonic_ns() < spin_end);
+    }
+    return poll(fds, nfds, timeout);
+}
+
 void install_signal_handler(int signal, void (*handler)(int), int flags) {
     struct sigaction action;
     sigset_t block_mask;
@@ -202,3 +376,216 @@ void install_signal_handler(int signal, void (*handler)(int), int flags) {
         syserr("sigaction");
     }
 }
+
+// Undo the string terminator put by frame_next() after the last message.
+static void frame_restore(frame_buf_t *frame) {
+    if (frame->cut != (size_t) -1) {
+        frame->data[frame->cut] = frame->cut_char;
+        frame->cut = (size_t) -1;
+    }
+}
+
+void frame_init(frame_buf_t *frame) {
+    memset(frame->data, 0, sizeof(frame->data));
+    frame->start = 0;
+    frame->end = 0;
+    frame->cut = (size_t) -1;
+    frame->cut_char = 0;
+    frame->compact = false;
+}
+
+// Makes room for new data at the end of the buffer. Returns its size.
+size_t frame_reserve(frame_buf_t *frame) {
+    frame_restore(frame);
+
+    // Move unconsumed data to the beginning of the buffer.
+    if (frame->start > 0) {
+        memmove(frame->data, frame->data + frame->start, frame->end - frame->start);
+        frame->end -= frame->start;
+        frame->start = 0;
+    }
+    // A message longer than the buffer can't be valid, drop it.
+    if (frame->end == BUF_SIZE) {
+        frame->end = 0;
+    }
+    return BUF_SIZE - frame->end;
+}
+
+// Reads whatever is available on the socket into the buffer. Returns the
+// result of read(), so 0 means that the peer closed the connection.
+ssize_t frame_fill(frame_buf_t *frame, int fd) {
+    size_t space = frame_reserve(frame);
+    ssize_t read_length = read(fd, frame->data + frame->end, space);
+    if (read_length > 0) {
+        frame->end += read_length;
+    }
+    return read_length;
+}
+
+// Returns the data received but not returned by frame_next() yet.
+char *frame_rest(frame_buf_t *frame, size_t *len) {
+    frame_restore(frame);
+    *len = frame->end - frame->start;
+    return frame->data + frame->start;
+}
+
+// Returns the position of the first "\r\n" in data[from, end) or end if there
+// is none. Plain byte by byte loop, used when the CPU has no usable vector
+// instructions.
+static size_t find_crlf_scalar(char const *data, size_t from, size_t end) {
+    for (size_t i = from; i + 1 < end; i++) {
+        if (data[i] == '\r' && data[i + 1] == '\n') {
+            return i;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Same as find_crlf_scalar(), but checks 16 positions at once: the block is
+// compared with '\r' and '\n' and the '\r' mask shifted by one, so a bit set
+// in both masks marks the end of "\r\n". A '\r' at the last position of the
+// block is carried into the next one.
+__attribute__((target("sse2")))
+static size_t find_crlf_sse2(char const *data, size_t from, size_t end) {
+    __m128i const cr = _mm_set1_epi8('\r');
+    __m128i const lf = _mm_set1_epi8('\n');
+    size_t i = from;
+    unsigned carry = 0;
+    for (; i + 16 <= end; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i const *) (data + i));
+        unsigned cr_mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+        unsigned lf_mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+        unsigned mask = ((cr_mask << 1) | carry) & lf_mask;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) - 1;
+        }
+        carry = cr_mask >> 15;
+    }
+    return find_crlf_scalar(data, i - carry, end);
+}
+
+// Same as find_crlf_sse2() with 32 byte blocks.
+__attribute__((target("avx2")))
+static size_t find_crlf_avx2(char const *data, size_t from, size_t end) {
+    __m256i const cr = _mm256_set1_epi8('\r');
+    __m256i const lf = _mm256_set1_epi8('\n');
+    size_t i = from;
+    unsigned carry = 0;
+    for (; i + 32 <= end; i += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i const *) (data + i));
+        unsigned cr_mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, cr));
+        unsigned lf_mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+        unsigned mask = ((cr_mask << 1) | carry) & lf_mask;
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) - 1;
+        }
+        carry = cr_mask >> 31;
+    }
+    return find_crlf_sse2(data, i - carry, end);
+}
+#endif
+
+// Search used by frame_next(), chosen on the first call.
+static size_t find_crlf_dispatch(char const *data, size_t from, size_t end);
+static size_t (*find_crlf)(char const *, size_t, size_t) = find_crlf_dispatch;
+
+// Switches frame_next() to the given implementation. Returns false if the CPU
+// doesn't support it.
+bool frame_use_scan(crlf_scan_t scan) {
+    switch (scan) {
+        case SCAN_SCALAR:
+            find_crlf = find_crlf_scalar;
+            return true;
+#if defined(__x86_64__) || defined(__i386__)
+        case SCAN_SSE2:
+            if (!__builtin_cpu_supports("sse2")) {
+                return false;
+            }
+            find_crlf = find_crlf_sse2;
+            return true;
+        case SCAN_AVX2:
+            if (!__builtin_cpu_supports("avx2")) {
+                return false;
+            }
+            find_crlf = find_crlf_avx2;
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+// Function to pick the search for this CPU and use it. AVX2 isn't the
+// default: our messages are shorter than its blocks, so most of them end up in
+// the SSE2 tail anyway and kierki-bench shows it slower than plain SSE2.
+static size_t find_crlf_dispatch(char const *data, size_t from, size_t end) {
+    if (!frame_use_scan(SCAN_SSE2)) {
+        frame_use_scan(SCAN_SCALAR);
+    }
+    return find_crlf(data, from, end);
+}
+
+// Returns the next complete message (with "\r\n", or the whole compact frame)
+// from the buffer or NULL if there is none. The message is terminated with
+// '\0' in place and stays valid until the next call on this buffer.
+char *frame_next(frame_buf_t *frame, size_t *len) {
+    frame_restore(frame);
+
+    size_t msg_end;
+    if (frame->compact) {
+        if (frame->start == frame->end) {
+            return NULL;
+        }
+        msg_end = frame->start + 1 + (uint8_t) frame->data[frame->start];
+        if (msg_end > frame->end) {
+            return NULL;
+        }
+    } else {
+        size_t i = find_crlf(frame->data, frame->start, frame->end);
+        if (i == frame->end) {
+            return NULL;
+        }
+        msg_end = i + 2;
+    }
+    char *msg = frame->data + frame->start;
+    *len = msg_end - frame->start;
+    frame->cut = msg_end;
+    frame->cut_char = frame->data[frame->cut];
+    frame->data[frame->cut] = '\0';
+    frame->start = frame->cut;
+    return msg;
+}
+
+// Parses a card ("10H", "QS", ...) from the string. Returns the number of
+// characters consumed or 0 if there is no valid card.
+size_t parse_card(char const *str, card_t *card) {
+    size_t ptr = 0;
+    char num = str[ptr++];
+    if (num == '1') {
+        if (str[ptr++] != '0') {
+            return 0;
+        }
+    } else if (!((num >= '2' && num <= '9') || num == 'J' || 
+                 num == 'Q' || num == 'K' || num == 'A')) {
+        return 0;
+    }
+    char col = str[ptr++];
+    if (col != 'C' && col != 'D' && col != 'H' && col != 'S') {
+        return 0;
+    }
+    card->num = num;
+    card->col = col;
+    return ptr;
+}
+
+// Writes a card to the string. Returns the number of characters written.
+size_t put_card(char *str, card_t card) {
+    size_t ptr = 0;
+    str[ptr++] = card.num;
+    if (card.num == '1') {
+        str[ptr++] = '0';
+    }
+    str[ptr++] = card.col;
+    return ptr;
+}
@@ -1,26 +1,67 @@
 #ifndef MIM_COMMON_H
 #define MIM_COMMON_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #define BUF_SIZE 1024
+#define ENDPOINT_SIZE 128 // Enough for format_endpoint() of any socket.
+#define NO_CARDS 13
+#define NO_PLAYERS 4
 
 typedef struct card_t {
     char num;
     char col;
 } card_t;
 
+// Buffer for splitting a stream into "\r\n" terminated messages.
+typedef struct frame_buf_t {
+    char data[BUF_SIZE + 1];
+    size_t start;    // Beginning of unconsumed data.
+    size_t end;      // End of received data.
+    size_t cut;      // Position of the terminator put by frame_next().
+    char cut_char;   // Character overwritten by the terminator.
+    bool compact;    // Messages are length-prefixed frames (see compact.h).
+} frame_buf_t;
+
+// Implementations of the "\r\n" search used by frame_next().
+typedef enum crlf_scan_t {
+    SCAN_SCALAR,
+    SCAN_SSE2,
+    SCAN_AVX2,
+} crlf_scan_t;
+
 uint16_t read_port(char const *string);
 time_t read_time(char const *string);
 size_t read_size(char const *string);
 struct sockaddr_storage get_server_address(char const *host, uint16_t port, int family);
 struct sockaddr_in get_server_address_ipv4(char const *host, uint16_t port);
 struct sockaddr_in6 get_server_address_ipv6(char const *host, uint16_t port);
+struct sockaddr_un get_unix_address(char const *path);
+bool format_endpoint(int socket_fd, bool peer, char *out, size_t size);
 char *read_msg(int socket_fd);
 ssize_t	readn(int fd, void *vptr, size_t n);
 ssize_t	writen(int fd, const void *vptr, size_t n);
+ssize_t writevn(int fd, struct iovec *iov, int iovcnt);
+ssize_t send_with_fd(int socket_fd, void const *data, size_t len, int fd);
+ssize_t recv_with_fd(int socket_fd, void *data, size_t size, int *fd);
+void set_low_latency(int socket_fd, int busy_poll_us);
+void pin_to_cpu(size_t cpu);
+int64_t monotonic_ns();
+int poll_spin(struct pollfd *fds, nfds_t nfds, int timeout, int64_t spin_ns);
 void install_signal_handler(int signal, void (*handler)(int), int flags);
+void frame_init(frame_buf_t *frame);
+size_t frame_reserve(frame_buf_t *frame);
+ssize_t frame_fill(frame_buf_t *frame, int fd);
+char *frame_next(frame_buf_t *frame, size_t *len);
+char *frame_rest(frame_buf_t *frame, size_t *len);
+bool frame_use_scan(crlf_scan_t scan);
+size_t parse_card(char const *str, card_t *card);
+size_t put_card(char *str, card_t card);
 
 #endif
@@ -0,0 +1,280 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "compact.h"
+
+// Types of the compact frames.
+typedef enum compact_type_t {
+    COMPACT_IAM = 1,
+    COMPACT_BUSY,
+    COMPACT_DEAL,
+    COMPACT_TRICK,
+    COMPACT_WRONG,
+    COMPACT_TAKEN,
+    COMPACT_SCORE,
+    COMPACT_TOTAL,
+    NO_COMPACT_TYPES,
+} compact_type_t;
+
+// Text prefixes of the messages of every type.
+static char const *const prefixes[NO_COMPACT_TYPES] = {
+    [COMPACT_IAM] = "IAM",
+    [COMPACT_BUSY] = "BUSY",
+    [COMPACT_DEAL] = "DEAL",
+    [COMPACT_TRICK] = "TRICK",
+    [COMPACT_WRONG] = "WRONG",
+    [COMPACT_TAKEN] = "TAKEN",
+    [COMPACT_SCORE] = "SCORE",
+    [COMPACT_TOTAL] = "TOTAL",
+};
+
+static char const ranks[] = "234567891JQKA"; // '1' stands for 10.
+static char const suits[] = "CDHS";
+static char const places[] = "NESW";
+
+#define NO_CARD_CODES 52
+#define NO_POINTS_BYTES 4
+
+// Function to get the byte of the place letter, 0 if invalid.
+static uint8_t place_code(char place) {
+    char const *found = strchr(places, place);
+    return place == '\0' || found == NULL ? 0 : (uint8_t) (found - places + 1);
+}
+
+// Function to check if the byte is a valid place.
+static bool is_place_code(uint8_t code) {
+    return code >= 1 && code <= NO_PLAYERS;
+}
+
+// Function to get the byte of a card parsed by parse_card().
+static uint8_t card_code(card_t card) {
+    return (uint8_t) ((strchr(ranks, card.num) - ranks) * 4 + (strchr(suits, card.col) - suits));
+}
+
+// Function to get the card of the byte.
+static card_t code_card(uint8_t code) {
+    card_t card = {ranks[code / 4], suits[code % 4]};
+    return card;
+}
+
+// Function to parse "<trick number><cards>" of the given length into the
+// frame. As cards may start with a digit too, both two and one digit numbers
+// are tried. Returns the number of bytes written, 0 if invalid.
+static size_t encode_numbered(uint8_t *out, char const *body, size_t body_len,
+                              int min_cards, int max_cards) {
+    for (size_t digits = 2; digits >= 1; digits--) {
+        if (body_len < digits) {
+            continue;
+        }
+        int trick_num = 0;
+        bool is_number = true;
+        for (size_t i = 0; i < digits; i++) {
+            is_number = is_number && body[i] >= '0' && body[i] <= '9';
+            trick_num = trick_num * 10 + (body[i] - '0');
+        }
+        if (!is_number || trick_num < 1 || trick_num > NO_CARDS) {
+            continue;
+        }
+
+        size_t len = 0;
+        out[len++] = (uint8_t) trick_num;
+        size_t pos = digits;
+        int no_cards = 0;
+        card_t card;
+        size_t card_len;
+        while (pos < body_len && no_cards < max_cards &&
+               (card_len = parse_card(body + pos, &card)) != 0 && pos + card_len <= body_len) {
+            out[len++] = card_code(card);
+            pos += card_len;
+            no_cards++;
+        }
+        if (pos == body_len && no_cards >= min_cards) {
+            return len;
+        }
+    }
+    return 0;
+}
+
+// Function to write the text message as a compact frame. Returns the length
+// of the frame, 0 if the message has no compact form.
+size_t compact_encode(uint8_t *frame, char const *msg) {
+    size_t msg_len = strlen(msg);
+    if (msg_len < strlen("\r\n") || strcmp(msg + msg_len - strlen("\r\n"), "\r\n") != 0) {
+        return 0;
+    }
+    int type = COMPACT_IAM;
+    while (type < NO_COMPACT_TYPES && strncmp(msg, prefixes[type], strlen(prefixes[type])) != 0) {
+        type++;
+    }
+    if (type == NO_COMPACT_TYPES) {
+        return 0;
+    }
+    char const *body = msg + strlen(prefixes[type]);
+    size_t body_len = msg_len - strlen(prefixes[type]) - strlen("\r\n");
+
+    size_t len = 2;
+    frame[1] = (uint8_t) type;
+    switch (type) {
+    case COMPACT_IAM:
+    case COMPACT_BUSY:
+        if ((type == COMPACT_IAM && body_len != 1) || body_len > NO_PLAYERS) {
+            return 0;
+        }
+        for (size_t i = 0; i < body_len; i++) {
+            if ((frame[len++] = place_code(body[i])) == 0) {
+                return 0;
+            }
+        }
+        break;
+    case COMPACT_DEAL: {
+        if (body_len < 2 || body[0] < '1' || body[0] > '9') {
+            return 0;
+        }
+        frame[len++] = (uint8_t) (body[0] - '0');
+        if ((frame[len++] = place_code(body[1])) == 0) {
+            return 0;
+        }
+        size_t pos = 2;
+        for (int i = 0; i < NO_CARDS; i++) {
+            card_t card;
+            size_t card_len = parse_card(body + pos, &card);
+            if (card_len == 0 || pos + card_len > body_len) {
+                return 0;
+            }
+            frame[len++] = card_code(card);
+            pos += card_len;
+        }
+        if (pos != body_len) {
+            return 0;
+        }
+        break;
+    }
+    case COMPACT_TRICK:
+    case COMPACT_WRONG:
+    case COMPACT_TAKEN: {
+        bool taken = type == COMPACT_TAKEN;
+        if (taken && body_len == 0) {
+            return 0;
+        }
+        int min_cards = taken ? NO_PLAYERS : 0;
+        int max_cards = type == COMPACT_WRONG ? 0 : NO_PLAYERS;
+        size_t written = encode_numbered(frame + len, body, body_len - taken, min_cards, max_cards);
+        if (written == 0) {
+            return 0;
+        }
+        len += written;
+        if (taken && (frame[len++] = place_code(body[body_len - 1])) == 0) {
+            return 0;
+        }
+        break;
+    }
+    case COMPACT_SCORE:
+    case COMPACT_TOTAL: {
+        unsigned points[NO_PLAYERS];
+        int parsed_len = 0;
+        if (sscanf(body, "N%uE%uS%uW%u%n", &points[0], &points[1], &points[2], &points[3],
+                   &parsed_len) != NO_PLAYERS || (size_t) parsed_len != body_len) {
+            return 0;
+        }
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            for (int b = NO_POINTS_BYTES - 1; b >= 0; b--) {
+                frame[len++] = (uint8_t) (points[i] >> (8 * b));
+            }
+        }
+        break;
+    }
+    }
+    frame[0] = (uint8_t) (len - 1);
+    return len;
+}
+
+// Function to write the compact frame of the given length as a text message.
+// Returns the length of the message, 0 if the frame is invalid.
+size_t compact_decode(char *msg, uint8_t const *frame, size_t len) {
+    if (len < 2 || (size_t) frame[0] + 1 != len || frame[1] < COMPACT_IAM ||
+        frame[1] >= NO_COMPACT_TYPES) {
+        return 0;
+    }
+    int type = frame[1];
+    uint8_t const *fields = frame + 2;
+    size_t no_fields = len - 2;
+
+    size_t msg_len = strlen(prefixes[type]);
+    memcpy(msg, prefixes[type], msg_len);
+    switch (type) {
+    case COMPACT_IAM:
+    case COMPACT_BUSY:
+        if ((type == COMPACT_IAM && no_fields != 1) || no_fields > NO_PLAYERS) {
+            return 0;
+        }
+        for (size_t i = 0; i < no_fields; i++) {
+            if (!is_place_code(fields[i])) {
+                return 0;
+            }
+            msg[msg_len++] = places[fields[i] - 1];
+        }
+        break;
+    case COMPACT_DEAL:
+        if (no_fields != 2 + NO_CARDS || fields[0] < 1 || fields[0] > 9 || !is_place_code(fields[1])) {
+            return 0;
+        }
+        msg[msg_len++] = (char) ('0' + fields[0]);
+        msg[msg_len++] = places[fields[1] - 1];
+        for (size_t i = 2; i < no_fields; i++) {
+            if (fields[i] >= NO_CARD_CODES) {
+                return 0;
+            }
+            msg_len += put_card(msg + msg_len, code_card(fields[i]));
+        }
+        break;
+    case COMPACT_TRICK:
+    case COMPACT_WRONG:
+    case COMPACT_TAKEN: {
+        if (no_fields == 0 || fields[0] < 1 || fields[0] > NO_CARDS) {
+            return 0;
+        }
+        size_t no_cards = no_fields - 1;
+        if (type == COMPACT_TAKEN) {
+            // Four cards and the taker.
+            if (no_cards != NO_PLAYERS + 1) {
+                return 0;
+            }
+            no_cards = NO_PLAYERS;
+        } else if (no_cards > (type == COMPACT_WRONG ? 0 : NO_PLAYERS)) {
+            return 0;
+        }
+        msg_len += sprintf(msg + msg_len, "%d", fields[0]);
+        for (size_t i = 1; i <= no_cards; i++) {
+            if (fields[i] >= NO_CARD_CODES) {
+                return 0;
+            }
+            msg_len += put_card(msg + msg_len, code_card(fields[i]));
+        }
+        if (type == COMPACT_TAKEN) {
+            if (!is_place_code(fields[no_fields - 1])) {
+                return 0;
+            }
+            msg[msg_len++] = places[fields[no_fields - 1] - 1];
+        }
+        break;
+    }
+    case COMPACT_SCORE:
+    case COMPACT_TOTAL:
+        if (no_fields != NO_PLAYERS * NO_POINTS_BYTES) {
+            return 0;
+        }
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            uint32_t points = 0;
+            for (int b = 0; b < NO_POINTS_BYTES; b++) {
+                points = points << 8 | fields[i * NO_POINTS_BYTES + b];
+            }
+            msg_len += sprintf(msg + msg_len, "%c%" PRIu32, places[i], points);
+        }
+        break;
+    }
+    memcpy(msg + msg_len, "\r\n", strlen("\r\n") + 1);
+    return msg_len + strlen("\r\n");
+}
@@ -0,0 +1,20 @@
+#ifndef MIM_COMPACT_H
+#define MIM_COMPACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compact binary form of the protocol. A client asks for it by sending
+// "IAM<place>C\r\n" instead of "IAM<place>\r\n", and from then on both sides
+// send frames: a byte with the length of the rest of the frame, a byte with
+// the type of the message and its fields. A card is one byte (rank * 4 + suit,
+// from 2C = 0 to AS = 51), a place is one byte (1 to 4 for N, E, S, W), the
+// trick number and the game type are one byte each and points are 32-bit
+// big-endian numbers.
+#define COMPACT_SUFFIX 'C'
+#define COMPACT_MAX_LEN 32 // Longest frame, with a margin.
+
+size_t compact_encode(uint8_t *frame, char const *msg);
+size_t compact_decode(char *msg, uint8_t const *frame, size_t len);
+
+#endif
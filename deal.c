@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "err.h"
+#include "common.h"
+#include "deal.h"
+
+// Function to count lines of game description file.
+static int count_lines(char const *file_name) {
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) {
+        syserr("Failed to open game description file.");
+    }
+
+    int line_count = 0;
+    int ch;
+
+    // Count the number of newline characters
+    while ((ch = fgetc(file)) != EOF) {
+        if (ch == '\n') {
+            line_count++;
+        }
+    }
+
+    fclose(file);
+
+    return line_count;
+}
+
+// Function to parse game description file.
+game_desc_t *load_game_file(char const *file_name, int *no_of_games) {
+    *no_of_games = count_lines(file_name) / 5;
+    
+    game_desc_t *game_desc = malloc(*no_of_games * sizeof(game_desc_t));
+    if (game_desc == NULL && *no_of_games > 0) {
+        syserr("malloc");
+    }
+
+    FILE *file = fopen(file_name, "r");
+    if (file == NULL) {
+        syserr("Failed to open game description file.");
+    }
+
+    for(int i = 0; i < *no_of_games; i++) {
+        game_desc[i].game_type = fgetc(file);
+        game_desc[i].starting_player = fgetc(file);
+        fgetc(file); // Skip the newline character.
+        for (int j = 0; j < NO_PLAYERS; j++) {
+            for(int k = 0; k < NO_CARDS; k++) {
+                game_desc[i].cards[j][k].num = fgetc(file);
+                if (game_desc[i].cards[j][k].num == '1') {
+                    fgetc(file); // Skip the '0' character.
+                }
+                game_desc[i].cards[j][k].col = fgetc(file);
+            }
+            fgetc(file); // Skip the newline character.
+        }
+    }
+
+    fclose(file);
+
+    return game_desc;
+}
+
+// Returns the next number of the pseudo-random sequence (splitmix64).
+uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+// Deals shuffled cards and picks the starting player. Game type is left
+// to the caller.
+void random_deal(game_desc_t *game, uint64_t *state) {
+    static char const nums[] = "234567891JQKA";
+    static char const cols[] = "CDHS";
+    card_t deck[NO_PLAYERS * NO_CARDS];
+    for (int i = 0; i < NO_PLAYERS * NO_CARDS; i++) {
+        deck[i].num = nums[i % NO_CARDS];
+        deck[i].col = cols[i / NO_CARDS];
+    }
+
+    // Fisher-Yates shuffle.
+    for (int i = NO_PLAYERS * NO_CARDS - 1; i > 0; i--) {
+        int j = (int) (next_random(state) % (uint64_t) (i + 1));
+        card_t temp = deck[i];
+        deck[i] = deck[j];
+        deck[j] = temp;
+    }
+
+    for (int i = 0; i < NO_PLAYERS * NO_CARDS; i++) {
+        game->cards[i / NO_CARDS][i % NO_CARDS] = deck[i];
+    }
+    game->starting_player = "NESW"[next_random(state) % NO_PLAYERS];
+}
+
+// Function to seed the generator, the state is spread by splitmix64 as the
+// authors of xoshiro recommend.
+void rng_seed(rng_t *rng, uint64_t seed) {
+    for (int i = 0; i < 4; i++) {
+        rng->s[i] = next_random(&seed);
+    }
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// Returns the next number of the sequence (xoshiro256**).
+uint64_t rng_next(rng_t *rng) {
+    uint64_t *s = rng->s;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Returns a uniform number below bound, without division in almost all
+// cases (Lemire's multiply and shift with rejection).
+static uint32_t rng_below(rng_t *rng, uint32_t bound) {
+    uint64_t product = (rng_next(rng) >> 32) * bound;
+    uint32_t low = (uint32_t) product;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            product = (rng_next(rng) >> 32) * bound;
+            low = (uint32_t) product;
+        }
+    }
+    return (uint32_t) (product >> 32);
+}
+
+// Function to write the deal of the given number as a binary record. Every
+// deal has its own generator, so any deal can be made again from the seed
+// and its number. Game types go round if game_type is 0.
+void generate_deal(uint8_t *record, uint64_t seed, uint64_t deal_num, char game_type) {
+    rng_t rng;
+    rng_seed(&rng, seed ^ (deal_num * UINT64_C(0x9e3779b97f4a7c15)));
+
+    // Fisher-Yates shuffle.
+    uint8_t *deck = record + 2;
+    for (int i = 0; i < NO_PLAYERS * NO_CARDS; i++) {
+        deck[i] = (uint8_t) i;
+    }
+    for (int i = NO_PLAYERS * NO_CARDS - 1; i > 0; i--) {
+        uint32_t j = rng_below(&rng, (uint32_t) i + 1);
+        uint8_t temp = deck[i];
+        deck[i] = deck[j];
+        deck[j] = temp;
+    }
+
+    record[0] = game_type != 0 ? (uint8_t) game_type : (uint8_t) ('1' + deal_num % NO_GAME_TYPES);
+    record[1] = (uint8_t) "NESW"[rng_below(&rng, NO_PLAYERS)];
+}
+
+// Function to read the binary record of a deal.
+void decode_deal(game_desc_t *game, uint8_t const *record) {
+    static char const nums[] = "234567891JQKA";
+    static char const cols[] = "CDHS";
+    game->game_type = (char) record[0];
+    game->starting_player = (char) record[1];
+    for (int i = 0; i < NO_PLAYERS * NO_CARDS; i++) {
+        card_t card = {nums[record[2 + i] / 4], cols[record[2 + i] % 4]};
+        game->cards[i / NO_CARDS][i % NO_CARDS] = card;
+    }
+}
+
+// Function to make the deal of the given number, like generate_deal().
+void seeded_deal(game_desc_t *game, uint64_t seed, uint64_t deal_num) {
+    uint8_t record[DEAL_RECORD_SIZE];
+    generate_deal(record, seed, deal_num, 0);
+    decode_deal(game, record);
+}
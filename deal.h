@@ -0,0 +1,35 @@
+#ifndef MIM_DEAL_H
+#define MIM_DEAL_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+// Struct to store information about game.
+typedef struct game_desc_t {
+    char game_type;
+    char starting_player;
+    card_t cards[NO_PLAYERS][NO_CARDS];
+} game_desc_t;
+
+// State of the xoshiro256** generator.
+typedef struct rng_t {
+    uint64_t s[4];
+} rng_t;
+
+// Binary form of a generated deal: the game type and the starting player as
+// characters, then the hands of N, E, S and W, one byte per card (rank * 4 +
+// suit, from 2C = 0 to AS = 51, like in the compact protocol).
+#define DEAL_RECORD_SIZE (2 + NO_PLAYERS * NO_CARDS)
+#define NO_GAME_TYPES 7
+
+game_desc_t *load_game_file(char const *file_name, int *no_of_games);
+uint64_t next_random(uint64_t *state);
+void random_deal(game_desc_t *game, uint64_t *state);
+void rng_seed(rng_t *rng, uint64_t seed);
+uint64_t rng_next(rng_t *rng);
+void generate_deal(uint8_t *record, uint64_t seed, uint64_t deal_num, char game_type);
+void decode_deal(game_desc_t *game, uint8_t const *record);
+void seeded_deal(game_desc_t *game, uint64_t seed, uint64_t deal_num);
+
+#endif
@@ -0,0 +1,171 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "hdr.h"
+
+void hdr_init(hdr_hist_t *hist, int64_t highest_trackable, int significant_figures) {
+    if (significant_figures < 1 || significant_figures > 5 || highest_trackable < 2) {
+        fatal("Invalid histogram parameters");
+    }
+    memset(hist, 0, sizeof(hdr_hist_t));
+    hist->highest_trackable = highest_trackable;
+
+    // Number of sub-buckets needed to keep the requested precision.
+    int64_t largest_single_unit = 2;
+    for (int i = 0; i < significant_figures; i++) {
+        largest_single_unit *= 10;
+    }
+    int magnitude = 0;
+    while ((INT64_C(1) << magnitude) < largest_single_unit) {
+        magnitude++;
+    }
+    hist->sub_bucket_half_count_magnitude = magnitude - 1;
+    hist->sub_bucket_count = 1 << magnitude;
+    hist->sub_bucket_half_count = hist->sub_bucket_count / 2;
+    hist->sub_bucket_mask = hist->sub_bucket_count - 1;
+
+    // Every next bucket covers twice the range of the previous one.
+    int64_t smallest_untrackable = hist->sub_bucket_count;
+    int buckets_needed = 1;
+    while (smallest_untrackable <= highest_trackable) {
+        if (smallest_untrackable > INT64_MAX / 2) {
+            buckets_needed++;
+            break;
+        }
+        smallest_untrackable <<= 1;
+        buckets_needed++;
+    }
+    hist->bucket_count = buckets_needed;
+    hist->counts_len = (buckets_needed + 1) * hist->sub_bucket_half_count;
+
+    hist->counts = calloc(hist->counts_len, sizeof(int64_t));
+    if (hist->counts == NULL) {
+        syserr("calloc");
+    }
+    hist->min = INT64_MAX;
+}
+
+void hdr_free(hdr_hist_t *hist) {
+    free(hist->counts);
+    hist->counts = NULL;
+}
+
+void hdr_reset(hdr_hist_t *hist) {
+    memset(hist->counts, 0, hist->counts_len * sizeof(int64_t));
+    hist->total_count = 0;
+    hist->min = INT64_MAX;
+    hist->max = 0;
+}
+
+// Function to find the bucket of a value.
+static int bucket_index(hdr_hist_t const *hist, int64_t value) {
+    int pow2ceiling = 64 - __builtin_clzll((uint64_t) (value | hist->sub_bucket_mask));
+    return pow2ceiling - (hist->sub_bucket_half_count_magnitude + 1);
+}
+
+// Function to find the position of a value in the counts array.
+static int counts_index(hdr_hist_t const *hist, int64_t value) {
+    int bucket = bucket_index(hist, value);
+    int sub_bucket = (int) (value >> bucket);
+    return ((bucket + 1) << hist->sub_bucket_half_count_magnitude) + 
+        (sub_bucket - hist->sub_bucket_half_count);
+}
+
+// Function to find the range of values counted in the given position.
+static int64_t lowest_equivalent_value(hdr_hist_t const *hist, int index, int64_t *range) {
+    int bucket = (index >> hist->sub_bucket_half_count_magnitude) - 1;
+    int sub_bucket = (index & (hist->sub_bucket_half_count - 1)) + hist->sub_bucket_half_count;
+    if (bucket < 0) {
+        sub_bucket -= hist->sub_bucket_half_count;
+        bucket = 0;
+    }
+    *range = INT64_C(1) << bucket;
+    return (int64_t) sub_bucket << bucket;
+}
+
+void hdr_record(hdr_hist_t *hist, int64_t value) {
+    if (value < 0) {
+        value = 0;
+    } else if (value > hist->highest_trackable) {
+        value = hist->highest_trackable;
+    }
+    hist->counts[counts_index(hist, value)]++;
+    hist->total_count++;
+    if (value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+// Records a value and corrects for coordinated omission: if the value took
+// longer than the expected interval between samples, the samples which were
+// not taken in the meantime are recorded as well.
+void hdr_record_corrected(hdr_hist_t *hist, int64_t value, int64_t expected_interval) {
+    hdr_record(hist, value);
+    if (expected_interval <= 0) {
+        return;
+    }
+    for (int64_t missing = value - expected_interval; missing >= expected_interval; 
+         missing -= expected_interval) {
+        hdr_record(hist, missing);
+    }
+}
+
+// Returns the value below which the given percent of the samples fall.
+int64_t hdr_percentile(hdr_hist_t const *hist, double percentile) {
+    if (hist->total_count == 0) {
+        return 0;
+    }
+    if (percentile > 100.0) {
+        percentile = 100.0;
+    }
+    int64_t target = (int64_t) ((percentile / 100.0) * hist->total_count + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+
+    int64_t count = 0;
+    for (int i = 0; i < hist->counts_len; i++) {
+        count += hist->counts[i];
+        if (count >= target) {
+            int64_t range;
+            int64_t value = lowest_equivalent_value(hist, i, &range) + range - 1;
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+double hdr_mean(hdr_hist_t const *hist) {
+    if (hist->total_count == 0) {
+        return 0;
+    }
+    double total = 0;
+    for (int i = 0; i < hist->counts_len; i++) {
+        if (hist->counts[i] != 0) {
+            // Middle of the range counted in this position.
+            int64_t range;
+            int64_t lowest = lowest_equivalent_value(hist, i, &range);
+            total += (double) hist->counts[i] * (lowest + (range - 1) / 2.0);
+        }
+    }
+    return total / hist->total_count;
+}
+
+// Function to print the count and percentiles of nanosecond values in
+// microseconds.
+void hdr_print(FILE *file, char const *name, hdr_hist_t const *hist) {
+    fprintf(file, "%-14s count %" PRId64 " mean %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f us\n",
+        name, hist->total_count, hdr_mean(hist) / 1000,
+        (double) hdr_percentile(hist, 50.0) / 1000,
+        (double) hdr_percentile(hist, 90.0) / 1000,
+        (double) hdr_percentile(hist, 99.0) / 1000,
+        (double) hdr_percentile(hist, 99.9) / 1000,
+        (double) hist->max / 1000);
+}
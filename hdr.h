@@ -0,0 +1,32 @@
+#ifndef MIM_HDR_H
+#define MIM_HDR_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// High dynamic range histogram: values are recorded with a fixed number of
+// significant decimal digits, so the memory does not depend on the range.
+typedef struct hdr_hist_t {
+    int64_t highest_trackable;
+    int sub_bucket_half_count_magnitude;
+    int sub_bucket_half_count;
+    int sub_bucket_count;
+    int64_t sub_bucket_mask;
+    int bucket_count;
+    int counts_len;
+    int64_t total_count;
+    int64_t min;
+    int64_t max;
+    int64_t *counts;
+} hdr_hist_t;
+
+void hdr_init(hdr_hist_t *hist, int64_t highest_trackable, int significant_figures);
+void hdr_free(hdr_hist_t *hist);
+void hdr_reset(hdr_hist_t *hist);
+void hdr_record(hdr_hist_t *hist, int64_t value);
+void hdr_record_corrected(hdr_hist_t *hist, int64_t value, int64_t expected_interval);
+int64_t hdr_percentile(hdr_hist_t const *hist, double percentile);
+double hdr_mean(hdr_hist_t const *hist);
+void hdr_print(FILE *file, char const *name, hdr_hist_t const *hist);
+
+#endif
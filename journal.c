@@ -0,0 +1,124 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "common.h"
+#include "journal.h"
+#include "metrics.h"
+
+// Thread writing the appended records in batches.
+static void *writer_main(void *arg) {
+    journal_t *journal = arg;
+    char *batch = NULL;
+    size_t batch_capacity = 0;
+
+    pthread_mutex_lock(&journal->mutex);
+    while (true) {
+        while (journal->pending_len == 0 && !journal->closing) {
+            pthread_cond_wait(&journal->appended, &journal->mutex);
+        }
+        if (journal->pending_len == 0) {
+            break;
+        }
+
+        // Take all the pending records, new ones go to the other buffer.
+        char *pending = journal->pending;
+        size_t pending_capacity = journal->pending_capacity;
+        size_t batch_len = journal->pending_len;
+        journal->pending = batch;
+        journal->pending_capacity = batch_capacity;
+        journal->pending_len = 0;
+        batch = pending;
+        batch_capacity = pending_capacity;
+        pthread_mutex_unlock(&journal->mutex);
+
+        ssize_t written_length = writen(journal->fd, batch, batch_len);
+        if (written_length < 0 || (size_t) written_length != batch_len) {
+            syserr("journal write");
+        }
+        if (fdatasync(journal->fd) < 0) {
+            syserr("fdatasync");
+        }
+        COUNT(COUNTER_JOURNAL_SYNCS, 1);
+        COUNT(COUNTER_JOURNAL_BYTES, batch_len);
+
+        pthread_mutex_lock(&journal->mutex);
+        journal->synced_bytes += batch_len;
+        journal->batches++;
+        pthread_cond_broadcast(&journal->synced);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+
+    free(batch);
+    return NULL;
+}
+
+// Function to create the journal file, an existing one is truncated.
+void journal_open(journal_t *journal, char const *path) {
+    memset(journal, 0, sizeof(journal_t));
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd < 0) {
+        syserr("open %s", path);
+    }
+
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->appended, NULL);
+    pthread_cond_init(&journal->synced, NULL);
+    errno = pthread_create(&journal->thread, NULL, writer_main, journal);
+    if (errno != 0) {
+        syserr("pthread_create");
+    }
+}
+
+// Function to add a record, it is written by the thread later.
+void journal_append(journal_t *journal, char const *record, size_t len) {
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->pending_len + len > journal->pending_capacity) {
+        size_t capacity = journal->pending_capacity == 0 ? BUF_SIZE : journal->pending_capacity;
+        while (journal->pending_len + len > capacity) {
+            capacity *= 2;
+        }
+        journal->pending = realloc(journal->pending, capacity);
+        if (journal->pending == NULL) {
+            syserr("realloc");
+        }
+        journal->pending_capacity = capacity;
+    }
+    memcpy(journal->pending + journal->pending_len, record, len);
+    journal->pending_len += len;
+    journal->appended_bytes += len;
+    pthread_cond_signal(&journal->appended);
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Function to wait until all the records appended so far are on the disk.
+void journal_sync(journal_t *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    uint64_t target = journal->appended_bytes;
+    while (journal->synced_bytes < target) {
+        pthread_cond_wait(&journal->synced, &journal->mutex);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+}
+
+// Function to write the remaining records and close the journal.
+void journal_close(journal_t *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->closing = true;
+    pthread_cond_signal(&journal->appended);
+    pthread_mutex_unlock(&journal->mutex);
+
+    errno = pthread_join(journal->thread, NULL);
+    if (errno != 0) {
+        syserr("pthread_join");
+    }
+    close(journal->fd);
+    free(journal->pending);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->appended);
+    pthread_cond_destroy(&journal->synced);
+}
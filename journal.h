@@ -0,0 +1,32 @@
+#ifndef MIM_JOURNAL_H
+#define MIM_JOURNAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only file written by a separate thread. Records appended while a
+// batch is being written wait for the next one, so there is one fdatasync
+// per batch instead of one per record.
+typedef struct journal_t {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t appended;  // Signalled when there is something to write.
+    pthread_cond_t synced;    // Signalled after every batch.
+    char *pending;            // Records waiting for the next batch.
+    size_t pending_len;
+    size_t pending_capacity;
+    uint64_t appended_bytes;
+    uint64_t synced_bytes;
+    uint64_t batches;
+    bool closing;
+} journal_t;
+
+void journal_open(journal_t *journal, char const *path);
+void journal_append(journal_t *journal, char const *record, size_t len);
+void journal_sync(journal_t *journal);
+void journal_close(journal_t *journal);
+
+#endif
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "common.h"
+#include "deal.h"
+#include "rules.h"
+#include "strategy.h"
+
+#define MAX_THREADS 256
+
+// Struct to store results of one thread.
+typedef struct arena_stats_t {
+    double sum[NO_PLAYERS];     // Sum of per-deal mean penalties of strategy.
+    double sum_sq[NO_PLAYERS];  // Sum of their squares.
+    uint64_t deals;
+    uint64_t hands;
+    uint64_t illegal;
+} arena_stats_t;
+
+// Struct to store data of one thread.
+typedef struct worker_t {
+    pthread_t thread;
+    int id;
+    arena_stats_t stats;
+} worker_t;
+
+// Command line arguments.
+strategy_t const *lineup[NO_PLAYERS]; // Strategies on N, E, S, W.
+uint64_t no_deals = 100000;
+char *game_file = NULL;
+uint64_t seed = 1;
+char game_type = 0;
+int no_threads = 0;
+
+// Distinct strategies in the lineup.
+strategy_t const *contestants[NO_PLAYERS];
+int no_contestants = 0;
+int contestant_of_seat[NO_PLAYERS];
+
+// Deals read from the file.
+game_desc_t *game_desc = NULL;
+int no_of_games = 0;
+
+// Function to parse command line arguments.
+static void parse_args(int argc, char *argv[]) {
+    char *lineup_str = "duck,random";
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 == argc) {
+            fatal("Missing value of %s", argv[i]);
+        }
+        if (strcmp(argv[i], "-s") == 0) {
+            lineup_str = argv[i + 1];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            no_deals = read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            game_file = argv[i + 1];
+        } else if (strcmp(argv[i], "-S") == 0) {
+            seed = read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            game_type = argv[i + 1][0];
+            if (game_type < '1' || game_type > '0' + NO_GAME_TYPES || argv[i + 1][1] != '\0') {
+                fatal("Invalid game type: %s", argv[i + 1]);
+            }
+        } else if (strcmp(argv[i], "-j") == 0) {
+            no_threads = (int) read_size(argv[i + 1]);
+            if (no_threads < 1 || no_threads > MAX_THREADS) {
+                fatal("Invalid number of threads: %s", argv[i + 1]);
+            }
+        } else {
+            fatal("Invalid argument: %s", argv[i]);
+        }
+    }
+
+    // Parse the lineup, repeating it to fill all the seats.
+    char *names = strdup(lineup_str);
+    if (names == NULL) {
+        syserr("strdup");
+    }
+    strategy_t const *listed[NO_PLAYERS];
+    int no_listed = 0;
+    for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (no_listed == NO_PLAYERS) {
+            fatal("At most %d strategies can play", NO_PLAYERS);
+        }
+        listed[no_listed] = find_strategy(name);
+        if (listed[no_listed] == NULL) {
+            fatal("Unknown strategy: %s", name);
+        }
+        no_listed++;
+    }
+    free(names);
+    if (no_listed == 0) {
+        fatal("Missing strategies");
+    }
+
+    for (int seat = 0; seat < NO_PLAYERS; seat++) {
+        lineup[seat] = listed[seat % no_listed];
+        int c = 0;
+        while (c < no_contestants && contestants[c] != lineup[seat]) {
+            c++;
+        }
+        if (c == no_contestants) {
+            contestants[no_contestants++] = lineup[seat];
+        }
+        contestant_of_seat[seat] = c;
+    }
+
+    if (no_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        no_threads = cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS : (int) cpus);
+    }
+}
+
+// Function to get the deal of the given number.
+static void get_deal(uint64_t deal_num, game_desc_t *game) {
+    if (game_desc != NULL) {
+        *game = game_desc[deal_num % no_of_games];
+        if (game_type != 0) {
+            game->game_type = game_type;
+        }
+    } else {
+        // Every deal has its own generator, so results don't depend on threads.
+        uint64_t state = seed ^ (deal_num * UINT64_C(0x9e3779b97f4a7c15));
+        random_deal(game, &state);
+        game->game_type = game_type != 0 ? game_type :
+            (char) ('1' + deal_num % NO_GAME_TYPES);
+    }
+}
+
+// Plays the deal with the given strategies on seats, adds up penalties.
+// Returns the number of illegal cards picked by the strategies.
+static int play_deal(game_desc_t const *game, strategy_t const *seats[NO_PLAYERS],
+                     uint64_t rng[NO_PLAYERS], int penalty[NO_PLAYERS]) {
+    card_t hands[NO_PLAYERS][NO_CARDS];
+    memcpy(hands, game->cards, sizeof(hands));
+    int illegal = 0;
+
+    int leader = (int) (strchr("NESW", game->starting_player) - "NESW");
+    for (int trick = 0; trick < NO_CARDS; trick++) {
+        card_t laid[NO_PLAYERS];
+        int who_played[NO_PLAYERS];
+        for (int k = 0; k < NO_PLAYERS; k++) {
+            int seat = (leader + k) % NO_PLAYERS;
+            int card_id = seats[seat]->pick(hands[seat], laid, k, &rng[seat]);
+            if (!is_legal_card(hands[seat], card_id, laid, k)) {
+                // The server would answer WRONG, play any legal card instead.
+                illegal++;
+                card_id = 0;
+                while (!is_legal_card(hands[seat], card_id, laid, k)) {
+                    card_id++;
+                }
+            }
+            laid[k] = hands[seat][card_id];
+            hands[seat][card_id].num = 0;
+            hands[seat][card_id].col = 0;
+            who_played[k] = seat;
+        }
+        leader = who_played[trick_winner(laid, NO_PLAYERS)];
+        penalty[leader] += trick_points(game->game_type, laid, trick);
+    }
+    return illegal;
+}
+
+// Thread playing its share of deals.
+static void *worker_main(void *arg) {
+    worker_t *worker = arg;
+    arena_stats_t *stats = &worker->stats;
+
+    for (uint64_t d = worker->id; d < no_deals; d += no_threads) {
+        game_desc_t game;
+        get_deal(d, &game);
+
+        // Duplicate format: the deal is played once with every rotation of
+        // the lineup, so each strategy gets the same cards as the others.
+        double deal_penalty[NO_PLAYERS] = {0};
+        int deal_hands[NO_PLAYERS] = {0};
+        for (int rotation = 0; rotation < NO_PLAYERS; rotation++) {
+            strategy_t const *seats[NO_PLAYERS];
+            uint64_t rng[NO_PLAYERS];
+            int penalty[NO_PLAYERS] = {0};
+            for (int seat = 0; seat < NO_PLAYERS; seat++) {
+                seats[seat] = lineup[(seat + rotation) % NO_PLAYERS];
+                rng[seat] = seed + d * NO_PLAYERS * NO_PLAYERS + rotation * NO_PLAYERS + seat;
+            }
+
+            stats->illegal += play_deal(&game, seats, rng, penalty);
+            stats->hands++;
+
+            for (int seat = 0; seat < NO_PLAYERS; seat++) {
+                int c = contestant_of_seat[(seat + rotation) % NO_PLAYERS];
+                deal_penalty[c] += penalty[seat];
+                deal_hands[c]++;
+            }
+        }
+
+        for (int c = 0; c < no_contestants; c++) {
+            double mean = deal_penalty[c] / deal_hands[c];
+            stats->sum[c] += mean;
+            stats->sum_sq[c] += mean * mean;
+        }
+        stats->deals++;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    if (game_file != NULL) {
+        game_desc = load_game_file(game_file, &no_of_games);
+        if (no_of_games == 0) {
+            fatal("No deals in the game description file.");
+        }
+    }
+
+    worker_t *workers = calloc(no_threads, sizeof(worker_t));
+    if (workers == NULL) {
+        syserr("calloc");
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < no_threads; i++) {
+        workers[i].id = i;
+        errno = pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+        if (errno != 0) {
+            syserr("pthread_create");
+        }
+    }
+
+    // Sum up the results of all threads.
+    arena_stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < no_threads; i++) {
+        errno = pthread_join(workers[i].thread, NULL);
+        if (errno != 0) {
+            syserr("pthread_join");
+        }
+        for (int c = 0; c < no_contestants; c++) {
+            total.sum[c] += workers[i].stats.sum[c];
+            total.sum_sq[c] += workers[i].stats.sum_sq[c];
+        }
+        total.deals += workers[i].stats.deals;
+        total.hands += workers[i].stats.hands;
+        total.illegal += workers[i].stats.illegal;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Print mean penalty per hand with 95% confidence interval.
+    printf("%-10s %12s %10s\n", "strategy", "penalty", "ci95");
+    for (int c = 0; c < no_contestants; c++) {
+        double n = (double) total.deals;
+        double mean = total.sum[c] / n;
+        double variance = n > 1 ? (total.sum_sq[c] - n * mean * mean) / (n - 1) : 0;
+        double ci = variance > 0 ? 1.96 * sqrt(variance / n) : 0;
+        printf("%-10s %12.4f %10.4f\n", contestants[c]->name, mean, ci);
+    }
+    printf("deals %" PRIu64 " games %" PRIu64 " illegal %" PRIu64 " threads %d "
+        "time %.2fs games/s %.0f\n", total.deals, total.hands, total.illegal,
+        no_threads, elapsed, total.hands / elapsed);
+
+    free(workers);
+    free(game_desc);
+}
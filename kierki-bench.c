@@ -0,0 +1,349 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "err.h"
+#include "common.h"
+#include "compact.h"
+#include "deal.h"
+#include "messages.h"
+#include "player.h"
+#include "ring.h"
+#include "rules.h"
+
+#define NS_IN_SEC INT64_C(1000000000)
+#define MIN_BENCH_TIME (NS_IN_SEC / 5)
+#define BATCH 64 // Messages written to the socket at once.
+
+// Benchmark doing the measured operation the given number of times.
+typedef void (*bench_fn)(size_t ops);
+
+// Allocations made so far, counted by the wrappers below. The program is
+// linked with -Wl,--wrap=malloc etc., so calls from our code end up here.
+uint64_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+// Results are accumulated here, so the compiler can't drop the work.
+volatile uint64_t sink;
+
+// Data of the benchmarks.
+int sockets[2];
+int ring_sockets[2];
+ring_t ring_server; // Both sides of one shared memory connection.
+ring_t ring_client;
+game_desc_t game = {
+    .game_type = '1',
+    .starting_player = 'N',
+    .cards = {
+        {{'2', 'C'}, {'3', 'C'}, {'4', 'C'}, {'5', 'C'}, {'6', 'C'}, {'7', 'C'}, {'8', 'C'},
+         {'9', 'C'}, {'1', 'C'}, {'J', 'C'}, {'Q', 'C'}, {'K', 'C'}, {'A', 'C'}},
+        {{'2', 'D'}, {'3', 'D'}, {'4', 'D'}, {'5', 'D'}, {'6', 'D'}, {'7', 'D'}, {'8', 'D'},
+         {'9', 'D'}, {'1', 'D'}, {'J', 'D'}, {'Q', 'D'}, {'K', 'D'}, {'A', 'D'}},
+        {{'2', 'H'}, {'3', 'H'}, {'4', 'H'}, {'5', 'H'}, {'6', 'H'}, {'7', 'H'}, {'8', 'H'},
+         {'9', 'H'}, {'1', 'H'}, {'J', 'H'}, {'Q', 'H'}, {'K', 'H'}, {'A', 'H'}},
+        {{'2', 'S'}, {'3', 'S'}, {'4', 'S'}, {'5', 'S'}, {'6', 'S'}, {'7', 'S'}, {'8', 'S'},
+         {'9', 'S'}, {'1', 'S'}, {'J', 'S'}, {'Q', 'S'}, {'K', 'S'}, {'A', 'S'}},
+    },
+};
+card_t trick[NO_PLAYERS] = {{'1', 'H'}, {'Q', 'H'}, {'2', 'S'}, {'K', 'H'}};
+int points[NO_PLAYERS] = {12, 0, 101, 7};
+char const trick_msg[] = "TRICK1210H\r\n";
+char const deal_msg[] = "DEAL1N2C3C4C5C6C7C8C9C10CJCQCKCAC\r\n";
+char batch[BATCH * sizeof(trick_msg)];
+size_t batch_len;
+char burst[BUF_SIZE]; // Pipelined DEAL and TRICK messages, as after one read.
+size_t burst_len;
+size_t bytes_per_op = 0; // Set for benchmarks reporting throughput.
+
+// Function to get current time in nanoseconds.
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NS_IN_SEC + ts.tv_nsec;
+}
+
+// Function to put a batch of messages into the socket.
+static void write_batch() {
+    if (writen(sockets[1], batch, batch_len) != (ssize_t) batch_len) {
+        syserr("writen");
+    }
+}
+
+static void bench_read_msg(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        if (i % BATCH == 0) {
+            write_batch();
+        }
+        char *msg = read_msg(sockets[0]);
+        sink += msg[0];
+        free(msg);
+    }
+    // Drain the rest of the last batch.
+    for (size_t i = ops % BATCH; i != 0 && i < BATCH; i++) {
+        free(read_msg(sockets[0]));
+    }
+}
+
+static void bench_frame_next(size_t ops) {
+    frame_buf_t frame;
+    frame_init(&frame);
+    size_t done = 0;
+    while (done < ops) {
+        write_batch();
+        size_t in_batch = 0;
+        while (in_batch < BATCH) {
+            if (frame_fill(&frame, sockets[0]) <= 0) {
+                syserr("frame_fill");
+            }
+            char *msg;
+            size_t len;
+            while ((msg = frame_next(&frame, &len)) != NULL) {
+                sink += len;
+                in_batch++;
+            }
+        }
+        done += BATCH;
+    }
+}
+
+// Same as bench_frame_next(), through shared memory.
+static void bench_ring(size_t ops) {
+    frame_buf_t frame;
+    frame_init(&frame);
+    size_t done = 0;
+    while (done < ops) {
+        for (int i = 0; i < BATCH; i++) {
+            if (!ring_write(&ring_client, trick_msg, strlen(trick_msg))) {
+                fatal("ring_write");
+            }
+        }
+        size_t in_batch = 0;
+        while (in_batch < BATCH) {
+            if (ring_fill(&ring_server, &frame) <= 0) {
+                syserr("ring_fill");
+            }
+            char *msg;
+            size_t len;
+            while ((msg = frame_next(&frame, &len)) != NULL) {
+                sink += len;
+                in_batch++;
+            }
+        }
+        done += BATCH;
+    }
+}
+
+// Splits the whole burst into messages, like frame_next() after a read that
+// returned many of them.
+static void bench_frame_scan(size_t ops) {
+    frame_buf_t frame;
+    frame_init(&frame);
+    for (size_t i = 0; i < ops; i++) {
+        memcpy(frame.data, burst, burst_len);
+        frame.start = 0;
+        frame.end = burst_len;
+        char *msg;
+        size_t len;
+        while ((msg = frame_next(&frame, &len)) != NULL) {
+            sink += len;
+        }
+    }
+}
+
+static void bench_deal_parse(size_t ops) {
+    player_t player;
+    char out[BUF_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        player_init(&player, 0, 'N', NULL);
+        sink += player_handle_msg(&player, deal_msg, out);
+    }
+}
+
+static void bench_parse_trick(size_t ops) {
+    card_t card;
+    for (size_t i = 0; i < ops; i++) {
+        sink += parse_trick_msg(trick_msg, &card) + card.num;
+    }
+}
+
+static void bench_resolve(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        sink += trick_winner(trick, NO_PLAYERS) + trick_points('7', trick, (int) (i % 13));
+    }
+}
+
+static void bench_numtoi(size_t ops) {
+    static char const nums[] = "234567891JQKA";
+    for (size_t i = 0; i < ops; i++) {
+        sink += numtoi(nums[i % 13]);
+    }
+}
+
+static void bench_format_deal(size_t ops) {
+    char msg[BUF_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        sink += format_deal(msg, &game, (int) (i % NO_PLAYERS) + 1);
+    }
+}
+
+static void bench_format_trick(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        char *msg = format_trick((int) (i % 13) + 1, trick);
+        sink += msg[5];
+        free(msg);
+    }
+}
+
+static void bench_format_taken(size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        char *msg = format_taken((int) (i % 13) + 1, trick, 'E');
+        sink += msg[5];
+        free(msg);
+    }
+}
+
+static void bench_format_wrong(size_t ops) {
+    char msg[BUF_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        format_wrong(msg, (int) (i % 13) + 1);
+        sink += msg[5];
+    }
+}
+
+static void bench_format_points(size_t ops) {
+    char msg[BUF_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        format_points(msg, i % 2 == 0 ? "SCORE" : "TOTAL", points);
+        sink += msg[5];
+    }
+}
+
+static void bench_compact_encode(size_t ops) {
+    uint8_t frame[COMPACT_MAX_LEN];
+    for (size_t i = 0; i < ops; i++) {
+        sink += compact_encode(frame, deal_msg);
+    }
+}
+
+static void bench_compact_decode(size_t ops) {
+    uint8_t frame[COMPACT_MAX_LEN];
+    size_t len = compact_encode(frame, deal_msg);
+    char msg[BUF_SIZE];
+    for (size_t i = 0; i < ops; i++) {
+        sink += compact_decode(msg, frame, len);
+    }
+}
+
+// Function to run the benchmark long enough to be measured and print the
+// time and allocations per operation.
+static void run(char const *name, bench_fn fn) {
+    size_t ops = BATCH;
+    int64_t elapsed;
+    uint64_t allocated;
+    while (true) {
+        uint64_t allocations_before = allocations;
+        int64_t start = now_ns();
+        fn(ops);
+        elapsed = now_ns() - start;
+        allocated = allocations - allocations_before;
+        if (elapsed >= MIN_BENCH_TIME) {
+            break;
+        }
+        ops *= 2;
+    }
+    printf("%-20s %12zu ops %10.1f ns/op %8.2f allocs/op", name, ops,
+        (double) elapsed / ops, (double) allocated / ops);
+    if (bytes_per_op > 0) {
+        printf(" %8.1f MB/s", (double) (bytes_per_op * ops) * NS_IN_SEC / elapsed / 1e6);
+    }
+    printf("\n");
+}
+
+// Function to run the burst splitting benchmark with each implementation of
+// the "\r\n" search the CPU supports.
+static void run_frame_scan() {
+    static struct {
+        char const *name;
+        crlf_scan_t scan;
+    } const scans[] = {
+        {"frame_scan scalar", SCAN_SCALAR},
+        {"frame_scan sse2", SCAN_SSE2},
+        {"frame_scan avx2", SCAN_AVX2},
+    };
+    bytes_per_op = burst_len;
+    for (size_t i = 0; i < sizeof(scans) / sizeof(scans[0]); i++) {
+        if (frame_use_scan(scans[i].scan)) {
+            run(scans[i].name, bench_frame_scan);
+        }
+    }
+    bytes_per_op = 0;
+}
+
+int main() {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+        syserr("socketpair");
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, ring_sockets) < 0) {
+        syserr("socketpair");
+    }
+    int memfd = ring_create(&ring_server, ring_sockets[0]);
+    if (memfd < 0 || !ring_map(&ring_client, dup(memfd), ring_sockets[1], false)) {
+        syserr("ring_create");
+    }
+    for (int i = 0; i < BATCH; i++) {
+        memcpy(batch + batch_len, trick_msg, strlen(trick_msg));
+        batch_len += strlen(trick_msg);
+    }
+    while (burst_len + strlen(deal_msg) + strlen(trick_msg) <= sizeof(burst)) {
+        memcpy(burst + burst_len, deal_msg, strlen(deal_msg));
+        burst_len += strlen(deal_msg);
+        memcpy(burst + burst_len, trick_msg, strlen(trick_msg));
+        burst_len += strlen(trick_msg);
+    }
+
+    run("read_msg", bench_read_msg);
+    run("frame_next", bench_frame_next);
+    run("ring", bench_ring);
+    run_frame_scan();
+    run("DEAL parsing", bench_deal_parse);
+    run("parse_trick", bench_parse_trick);
+    run("resolve", bench_resolve);
+    run("numtoi", bench_numtoi);
+    run("format_deal", bench_format_deal);
+    run("format_trick", bench_format_trick);
+    run("format_taken", bench_format_taken);
+    run("format_wrong", bench_format_wrong);
+    run("format_points", bench_format_points);
+    run("compact_encode DEAL", bench_compact_encode);
+    run("compact_decode DEAL", bench_compact_decode);
+
+    close(sockets[0]);
+    close(sockets[1]);
+    ring_free(&ring_server);
+    ring_free(&ring_client);
+    close(ring_sockets[0]);
+    close(ring_sockets[1]);
+}
@@ -0,0 +1,106 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "common.h"
+#include "deal.h"
+
+#define OUT_SIZE (1 << 20)
+#define MAX_TEXT_DEAL 128 // Longest deal in the text format, with a margin.
+
+// Command line arguments.
+uint64_t no_deals = 1;
+uint64_t seed = 1;
+char game_type = 0;
+bool binary = false;
+
+// Output waiting to be written.
+char out[OUT_SIZE];
+size_t out_len = 0;
+
+// Cards in the text format by their byte, with lengths.
+char card_texts[NO_PLAYERS * NO_CARDS][3];
+size_t card_lens[NO_PLAYERS * NO_CARDS];
+
+// Function to parse command line arguments.
+static void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            binary = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            fatal("Missing value of %s", argv[i]);
+        }
+        if (strcmp(argv[i], "-n") == 0) {
+            no_deals = read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-S") == 0) {
+            seed = read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            game_type = argv[i + 1][0];
+            if (game_type < '1' || game_type > '0' + NO_GAME_TYPES || argv[i + 1][1] != '\0') {
+                fatal("Invalid game type: %s", argv[i + 1]);
+            }
+        } else {
+            fatal("Invalid argument: %s", argv[i]);
+        }
+        i++;
+    }
+}
+
+// Function to write out everything collected so far.
+static void flush_out() {
+    if (out_len > 0 && writen(STDOUT_FILENO, out, out_len) != (ssize_t) out_len) {
+        syserr("write");
+    }
+    out_len = 0;
+}
+
+// Function to append the deal in the format of the server's game files.
+static void put_text_deal(uint8_t const *record) {
+    char *text = out + out_len;
+    size_t len = 0;
+    text[len++] = (char) record[0];
+    text[len++] = (char) record[1];
+    text[len++] = '\n';
+    for (int i = 0; i < NO_PLAYERS * NO_CARDS; i++) {
+        // Three bytes are copied, the next card overwrites what's too much.
+        memcpy(text + len, card_texts[record[2 + i]], 3);
+        len += card_lens[record[2 + i]];
+        if (i % NO_CARDS == NO_CARDS - 1) {
+            text[len++] = '\n';
+        }
+    }
+    out_len += len;
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    for (int code = 0; code < NO_PLAYERS * NO_CARDS; code++) {
+        game_desc_t game;
+        uint8_t record[DEAL_RECORD_SIZE] = {'1', 'N', (uint8_t) code};
+        decode_deal(&game, record);
+        card_lens[code] = put_card(card_texts[code], game.cards[0][0]);
+    }
+
+    for (uint64_t deal_num = 0; deal_num < no_deals; deal_num++) {
+        if (OUT_SIZE - out_len < MAX_TEXT_DEAL) {
+            flush_out();
+        }
+        if (binary) {
+            generate_deal((uint8_t *) out + out_len, seed, deal_num, game_type);
+            out_len += DEAL_RECORD_SIZE;
+        } else {
+            uint8_t record[DEAL_RECORD_SIZE];
+            generate_deal(record, seed, deal_num, game_type);
+            put_text_deal(record);
+        }
+    }
+    flush_out();
+    return 0;
+}
@@ -15,14 +15,21 @@
 #include <pthread.h>
 #include <poll.h>
 #include <termios.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
-#define IAM_LEN 6
-#define TRICK_LEN 10
-#define NO_CARDS 13
-#define NO_PLAYERS 4
+#define MAX_SERVERS 64
+#define MAX_EVENTS 64
+#define RECONNECT_DELAY_MS 100
+#define MAX_RECONNECT_DELAY_MS 5000
 
 #include "err.h"
 #include "common.h"
+#include "player.h"
+#include "compact.h"
+#include "ring.h"
+#include "strategy.h"
+#include "probes.h"
 
 // Command line arguments.
 char *hostname;
@@ -30,17 +37,34 @@ uint16_t port;
 int family = AF_UNSPEC;
 char game_side;
 bool is_automatic = false;
-
-// Game data.
-char game_type;
-char starting_player;
-card_t cards[NO_CARDS];
-
-// Helping data for communication with user.
-int message_num; // Also a trick number.
-card_t tricks[NO_CARDS + 6][NO_PLAYERS];
-card_t card_played;
-bool is_finished = false;
+bool compact = false;
+char *unix_path = NULL; // Server socket on this host, instead of host and port.
+bool use_ring = false;  // Talk through shared memory, over the Unix socket.
+int busy_poll_us = 0;   // Spin before going to sleep, 0 if not.
+int pinned_cpu = -1;    // CPU running the client, -1 if any.
+
+// Command line arguments of the multi-seat mode.
+char *hostnames[MAX_SERVERS];
+uint16_t ports[MAX_SERVERS];
+int no_hostnames = 0;
+int no_ports = 0;
+char *seat_list = NULL;
+size_t seat_repeat = 1;
+int reconnect_attempts = 10;
+
+// Struct to store a player of the multi-seat mode.
+typedef struct seat_t {
+    player_t player;
+    int host;          // Index of the server.
+    int attempts;      // Attempts to connect again since the deal was resumed.
+    int64_t retry_at;  // When to connect again (ms), 0 if connected.
+    ring_t ring;
+} seat_t;
+
+// Player of the single seat mode.
+player_t player;
+ring_t ring;
+int reconnect_attempt = 0; // Attempts since the deal was last resumed.
 
 // Function to parse command line arguments.
 static void parse_args(int argc, char *argv[]) {
@@ -54,22 +78,79 @@ static void parse_args(int argc, char *argv[]) {
             if (i + 1 == argc) {
                 fatal("Missing hostname");
             }
+            if (no_hostnames == MAX_SERVERS) {
+                fatal("Too many hostnames");
+            }
             hostname = argv[i + 1];
+            hostnames[no_hostnames++] = hostname;
             hostname_set = true;
             i++;
         } else if (strcmp(argv[i], "-p") == 0) {
             if (i + 1 == argc) {
                 fatal("Missing port number");
             }
+            if (no_ports == MAX_SERVERS) {
+                fatal("Too many port numbers");
+            }
             port = read_port(argv[i + 1]);
+            ports[no_ports++] = port;
             port_set = true;
             i++;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing Unix socket path");
+            }
+            unix_path = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-M") == 0) {
+            use_ring = true;
+        } else if (strcmp(argv[i], "-B") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing busy poll time");
+            }
+            busy_poll_us = (int) read_size(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-C") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing CPU number");
+            }
+            pinned_cpu = (int) read_size(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing seat list");
+            }
+            seat_list = argv[i + 1];
+            for (size_t j = 0; seat_list[j] != '\0'; j++) {
+                if (strchr("NESW*", seat_list[j]) == NULL) {
+                    fatal("Invalid seat list: %s", seat_list);
+                }
+            }
+            if (seat_list[0] == '\0') {
+                fatal("Invalid seat list: %s", seat_list);
+            }
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing repeat count");
+            }
+            seat_repeat = read_size(argv[i + 1]);
+            i++;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (i + 1 == argc) {
+                fatal("Missing number of reconnection attempts");
+            }
+            reconnect_attempts = (int) read_size(argv[i + 1]);
+            i++;
         } else if (strcmp(argv[i], "-4") == 0) {
             family = AF_INET;
         } else if (strcmp(argv[i], "-6") == 0) {
             family = AF_INET6;
         } else if (strcmp(argv[i], "-a") == 0) {
             is_automatic = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            // Compact binary form of the protocol.
+            compact = true;
         } else if (strcmp(argv[i], "-N") == 0) {
             game_side = 'N';
             game_side_set = true;
@@ -82,35 +163,95 @@ static void parse_args(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "-W") == 0) {
             game_side = 'W';
             game_side_set = true;
+        } else if (strcmp(argv[i], "-A") == 0) {
+            // Any seat, the server picks one.
+            game_side = '*';
+            game_side_set = true;
         } else {
             fatal("Invalid argument: %s", argv[i]);
         }
     }
-    if (!hostname_set ||!port_set ||!game_side_set) {
+    if (use_ring && unix_path == NULL) {
+        fatal("Shared memory needs a Unix socket path");
+    }
+    if (unix_path != NULL) {
+        // The only server is the one listening on the socket.
+        if (hostname_set || port_set) {
+            fatal("Unix socket path given together with a server address");
+        }
+        hostnames[no_hostnames++] = NULL;
+        ports[no_ports++] = 0;
+        hostname_set = true;
+        port_set = true;
+    }
+    if (seat_list != NULL) {
+        // Multi-seat mode: seats are taken from the list on every server.
+        if (!hostname_set || no_hostnames != no_ports) {
+            fatal("Every hostname needs a port number");
+        }
+        is_automatic = true;
+    } else if (!hostname_set ||!port_set ||!game_side_set) {
         fatal("Missing obligatory argument");
     }
 }
 
-// Function to initialize connection to the server.
-static int prepare_connection() {
+// Function to connect to the server. Returns -1 if the server is unreachable.
+static int try_connection(char const *host, uint16_t host_port) {
     // Get server address info.
-    struct sockaddr_storage server_address = get_server_address(hostname, port, family);
-    family = server_address.ss_family;
+    struct sockaddr_storage server_address;
+    socklen_t server_address_len = sizeof(server_address);
+    if (unix_path != NULL) {
+        struct sockaddr_un unix_address = get_unix_address(unix_path);
+        memcpy(&server_address, &unix_address, sizeof(unix_address));
+        server_address_len = sizeof(unix_address);
+    } else {
+        server_address = get_server_address(host, host_port, family);
+    }
 
     // Create socket.
-    int socket_fd = socket(family, SOCK_STREAM, 0);
+    int socket_fd = socket(server_address.ss_family, SOCK_STREAM, 0);
     if (socket_fd < 0) {
         syserr("cannot create a socket");
     }
 
-    if (connect(socket_fd, (struct sockaddr *) &server_address,
-                (socklen_t) sizeof(server_address)) < 0) {
-        syserr("cannot connect to the server");
+    if (connect(socket_fd, (struct sockaddr *) &server_address, server_address_len) < 0) {
+        close(socket_fd);
+        PROBE1(connect, -1);
+        return -1;
+    }
+    PROBE1(connect, socket_fd);
+    if (busy_poll_us > 0) {
+        set_low_latency(socket_fd, busy_poll_us);
     }
 
     return socket_fd;
 }
 
+// Function to initialize connection to the server.
+static int prepare_connection(char const *host, uint16_t host_port) {
+    int socket_fd = try_connection(host, host_port);
+    if (socket_fd < 0) {
+        syserr("cannot connect to the server");
+    }
+    return socket_fd;
+}
+
+// Function to get current time in milliseconds.
+static int64_t current_time_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to get the delay before the given reconnection attempt.
+static int64_t reconnect_delay_ms(int attempt) {
+    int64_t delay = RECONNECT_DELAY_MS;
+    for (int i = 0; i < attempt && delay < MAX_RECONNECT_DELAY_MS; i++) {
+        delay *= 2;
+    }
+    return delay < MAX_RECONNECT_DELAY_MS ? delay : MAX_RECONNECT_DELAY_MS;
+}
+
 // Function to print raport about exchanged messages.
 static void raport(int socket_fd, char *msg, bool from_server) {
     // Get the current time
@@ -129,642 +270,285 @@ static void raport(int socket_fd, char *msg, bool from_server) {
         syserr("strftime");
     }
 
-    if (family == AF_INET) {
-        // Get local IP address and port
-        struct sockaddr_in local_address;
-        socklen_t local_address_len = sizeof(local_address);
-        if (getsockname(socket_fd, (struct sockaddr *) &local_address, &local_address_len) == -1) {
-            syserr("getsockname");
-        }
-        char local_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &local_address.sin_addr, local_ip, sizeof(local_ip));
-        int local_port = ntohs(local_address.sin_port);
-
-        // Get server IP address and port
-        struct sockaddr_in server_address;
-        socklen_t server_address_len = sizeof(server_address);
-        if (getpeername(socket_fd, (struct sockaddr *) &server_address, &server_address_len) == -1) {
-            syserr("getpeername");
-        }
-        char server_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &server_address.sin_addr, server_ip, sizeof(server_ip));
-        int server_port = ntohs(server_address.sin_port);
-
-        // Print the whole raport.
-        msg[strlen(msg) - 2] = '\0';
-        if (from_server) {
-            printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", server_ip, server_port, 
-                local_ip, local_port, time_str, tv.tv_usec / 1000, msg);
-        } else {
-            printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", local_ip, local_port, 
-                server_ip, server_port, time_str, tv.tv_usec / 1000, msg);
-        }
-        msg[strlen(msg)] = '\r';
+    // Get local and server addresses.
+    char local_endpoint[ENDPOINT_SIZE];
+    if (!format_endpoint(socket_fd, false, local_endpoint, sizeof(local_endpoint))) {
+        syserr("getsockname");
+    }
+    char server_endpoint[ENDPOINT_SIZE];
+    if (!format_endpoint(socket_fd, true, server_endpoint, sizeof(server_endpoint))) {
+        syserr("getpeername");
+    }
+
+    // Print the whole raport.
+    msg[strlen(msg) - 2] = '\0';
+    if (from_server) {
+        printf("[%s,%s,%s.%03ld] %s\\r\\n\n", server_endpoint, local_endpoint,
+            time_str, tv.tv_usec / 1000, msg);
     } else {
-        // Get local IP address and port
-        struct sockaddr_in6 local_address;
-        socklen_t local_address_len = sizeof(local_address);
-        if (getsockname(socket_fd, (struct sockaddr *) &local_address, &local_address_len) == -1) {
-            syserr("getsockname");
-        }
-        char local_ip[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &(local_address.sin6_addr), local_ip, sizeof(local_ip));
-        int local_port = ntohs(local_address.sin6_port);
-
-        // Get server IP address and port
-        struct sockaddr_in6 server_address;
-        socklen_t server_address_len = sizeof(server_address);
-        if (getpeername(socket_fd, (struct sockaddr *) &server_address, &server_address_len) == -1) {
-            syserr("getpeername");
+        printf("[%s,%s,%s.%03ld] %s\\r\\n\n", local_endpoint, server_endpoint,
+            time_str, tv.tv_usec / 1000, msg);
+    }
+    msg[strlen(msg)] = '\r';
+}
+
+// Function to send a message to the server, in the compact form if asked to,
+// through the ring if the connection uses one.
+static bool send_msg(int socket_fd, ring_t *msg_ring, char *msg, size_t msg_len, bool in_compact) {
+    if (is_automatic) {
+        raport(socket_fd, msg, false);
+    }
+    PROBE2(msg_send, socket_fd, msg);
+
+    uint8_t frame[COMPACT_MAX_LEN];
+    if (in_compact) {
+        msg_len = compact_encode(frame, msg);
+        msg = (char *) frame;
+    }
+    if (msg_ring != NULL && msg_ring->shared != NULL) {
+        return ring_write(msg_ring, msg, msg_len);
+    }
+    ssize_t written_length = writen(socket_fd, msg, msg_len);
+    return written_length >= 0 && (size_t) written_length == msg_len;
+}
+
+// Function to introduce the player to the server and, if asked to, move the
+// connection to the shared memory the server sends back. Returns false if the
+// connection is broken.
+static bool introduce(player_t *p, ring_t *p_ring) {
+    char msg[BUF_SIZE];
+    size_t msg_len = player_iam(p, msg);
+    if (use_ring) {
+        // The suffix goes after the one of the compact form.
+        memcpy(msg + msg_len - strlen("\r\n"), (char[]) {RING_SUFFIX, '\r', '\n', '\0'}, 4);
+        msg_len++;
+    }
+    if (!send_msg(p->fd, NULL, msg, msg_len, false)) {
+        return false;
+    }
+    return !use_ring || ring_join(p_ring, p->fd);
+}
+
+// Function to read what the server sent into the player's buffer. Returns
+// like frame_fill(), -1 with errno EAGAIN if nothing came through the ring.
+static ssize_t receive(player_t *p, ring_t *p_ring) {
+    if (p_ring->shared != NULL) {
+        return ring_fill(p_ring, &p->in);
+    }
+    return frame_fill(&p->in, p->fd);
+}
+
+// Function to print a card to the user.
+static void print_card(card_t card) {
+    printf("%c", card.num);
+    if (card.num == '1') {
+        printf("0");
+    }
+    printf("%c", card.col);
+}
+
+// Function to print a list of cards to the user, skipping empty places.
+static void print_cards(card_t const *cards, int count) {
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        if (cards[i].num == 0) {
+            continue;
         }
-        char server_ip[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &(server_address.sin6_addr), server_ip, sizeof(server_ip));
-        int server_port = ntohs(server_address.sin6_port);
-
-        // Print the whole raport.
-        msg[strlen(msg) - 2] = '\0';
-        if (from_server) {
-            printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", server_ip, server_port, 
-                local_ip, local_port, time_str, tv.tv_usec / 1000, msg);
-        } else {
-            printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", local_ip, local_port, 
-                server_ip, server_port, time_str, tv.tv_usec / 1000, msg);
+        if (!first) {
+            printf(", ");
         }
-        msg[strlen(msg)] = '\r';
+        first = false;
+        print_card(cards[i]);
     }
 }
 
 // Function to print received message to the user.
-static void user_interface(char *msg) {
-    // Print BUSY message.
-    if (strncmp(msg, "BUSY", 4) == 0) {
-        char places[3];
-        int place = 0;
-        for (int i = strlen("BUSY"); msg[i] != '\r'; i++) {
-            places[place++] = msg[i];
-        }
-        printf("%s", msg);
+static void user_interface(char const *msg, int trick_before) {
+    // The message as received, then what it means.
+    printf("%s", msg);
+    switch (player_msg_type(msg)) {
+    case MSG_IAM:
+        printf("Place %c assigned.\n", player.seat);
+        break;
+    case MSG_BUSY:
         printf("Place busy, list of busy places received: ");
-        for (int i = 0; i < place - 1; i++) {
-            printf("%c, ", places[i]);
-        }
-        printf("%c.\n", places[place - 1]);
-    }
-    // Print DEAL message.
-    else if (strncmp(msg, "DEAL", 4) == 0) {
-        printf("%s", msg);
-        printf("New deal %c: staring place %c, your cards: ", game_side, starting_player);
-        for(int i = 0; i < NO_CARDS - 1; i++) {
-            printf("%c", cards[i].num);
-            if (cards[i].num == '1') {
-                printf("0");
-            }
-            printf("%c, ", cards[i].col);
-        }
-        printf("%c", cards[NO_CARDS - 1].num);
-        if (cards[NO_CARDS - 1].num == '1') {
-            printf("0");
-        }
-        printf("%c.\n", cards[NO_CARDS - 1].col);
-    }
-    // Print WRONG message.
-    else if (strncmp(msg, "WRONG", 5) == 0) {
-        printf("%s", msg);
-        int ptr = strlen("WRONG");
-        printf("Wrong message received in trick ");
-        while (msg[ptr]!= '\r') {
-            printf("%c", msg[ptr++]);
+        for (int i = 0; player.busy[i] != '\0'; i++) {
+            printf(i == 0 ? "%c" : ", %c", player.busy[i]);
         }
         printf(".\n");
-    }
-    // Print TAKEN message.
-    else if (strncmp(msg, "TAKEN", 5) == 0) {
-        printf("%s", msg);
-        int ptr = strlen("TAKEN") + (message_num >= 9 ? 2 : 1);
-        printf("A trick %d is taken by %c, cards ", message_num + 1, 
-            msg[strlen(msg) - 1 - strlen("\r\n")]);
-        while (msg[ptr + 1]!= '\r') {
-            printf("%c", msg[ptr]);
-            if(msg[ptr] == 'C' || msg[ptr] == 'D' || 
-               msg[ptr] == 'H' || msg[ptr] == 'S') {
-                if (msg[ptr + 2] != '\r') {
-                    printf(", ");
-                }
-            }
-            ptr++;
-        }
+        break;
+    case MSG_DEAL:
+        printf("New deal %c: starting place %c, your cards: ", player.game_type,
+            player.starting_player);
+        print_cards(player.cards, NO_CARDS);
         printf(".\n");
-    }
-    // Print SCORE message.
-    else if (strncmp(msg, "SCORE", 5) == 0) {
-        printf("%s", msg);
-        printf("The scores are:\n");
-        int ptr = strlen("SCORE");
+        break;
+    case MSG_WRONG:
+        printf("Wrong message received in trick %d.\n", player.trick_num);
+        break;
+    case MSG_TAKEN:
+        if (player.trick_num != trick_before) {
+            printf("A trick %d is taken by %c, cards ", trick_before,
+                player.taken_by[trick_before - 1]);
+            print_cards(player.tricks[trick_before - 1], NO_PLAYERS);
+            printf(".\n");
+        }
+        break;
+    case MSG_SCORE:
+    case MSG_TOTAL: {
+        bool is_score = player_msg_type(msg) == MSG_SCORE;
+        printf(is_score ? "The scores are:\n" : "The total scores are:\n");
         for (int i = 0; i < NO_PLAYERS; i++) {
-            printf("%c | ", msg[ptr++]);
-            while (msg[ptr] >= '0' && msg[ptr] <= '9') {
-                printf("%c", msg[ptr++]);
-            }
-            printf("\n");
+            printf("%c | %d\n", "NESW"[i], is_score ? player.scores[i] : player.totals[i]);
         }
+        break;
     }
-    // Print TOTAL message.
-    else if (strncmp(msg, "TOTAL", 5) == 0) {
-        printf("%s", msg);
-        printf("The total scores are:\n");
-        int ptr = strlen("SCORE");
-        for (int i = 0; i < NO_PLAYERS; i++) {
-            printf("%c | ", msg[ptr++]);
-            while (msg[ptr] >= '0' && msg[ptr] <= '9') {
-                printf("%c", msg[ptr++]);
-            }
-            printf("\n");
-        }
-    }
-    // Print TRICK message.
-    else {
-        printf("%ld %s", strlen(msg), msg);
-        printf("Trick: (%d) ", message_num + 1);
-        int ptr = strlen("TRICK") + (message_num >= 9 ? 2 : 1);
-        while (msg[ptr]!= '\r') {
-            printf("%c", msg[ptr]);
-            if(msg[ptr] == 'C' || msg[ptr] == 'D' || 
-               msg[ptr] == 'H' || msg[ptr] == 'S') {
-                if (msg[ptr + 1] != '\r') {
-                    printf(", ");
-                }
-            }
-            ptr++;
-        }
+    case MSG_TRICK:
+        printf("Trick: (%d) ", player.trick_num);
+        print_cards(player.laid, player.laid_count);
         printf("\nAvailable: ");
-        for (int i = 0; i < NO_CARDS; i++) {
-            if (cards[i].num == 0) {
-                continue;
-            } else {
-                printf("%c", cards[i].num);
-                if (cards[i].num == '1') {
-                    printf("0");
-                }
-                printf("%c", cards[i].col);
-                if (i!= NO_CARDS - 1) {
-                    printf(", ");
-                }
-            }
-        }
+        print_cards(player.cards, NO_CARDS);
         printf("\n");
+        break;
+    default:
+        break;
     }
 }
 
-// Function to get game data from the server.
-static int get_game_info(int socket_fd) {
-    // Receiving DEAL message.
-    char *msg = read_msg(socket_fd);
-    int msg_len = strlen(msg);
-    
-    if (is_automatic) {
-        raport(socket_fd, msg, true);
+// Function to handle the end of connection with the server. After the last
+// deal we are done, during the deal we connect again and take the same place.
+static void connection_closed() {
+    ring_free(&ring);
+    close(player.fd);
+    if (player.state == PLAYER_IDLE) {
+        exit(0);
     }
 
-    if (msg_len < 2 || msg[msg_len - 2] != '\r' || msg[msg_len - 1] != '\n') {
-        free(msg);
-        return get_game_info(socket_fd);
-    } else {
-        if (strncmp(msg, "BUSY", 4) == 0) {
-            exit(1);
-        } else if (strncmp(msg, "DEAL", 4) == 0) {
-            
-            // Fill game data.
-            game_type = msg[4];
-            starting_player = msg[5];
-            size_t ptr = 5;
-            for (int i = 0; i < NO_CARDS; i++) {
-                cards[i].num = msg[++ptr];
-                if (msg[ptr] == '1') {
-                    ptr++;
-                }
-                cards[i].col = msg[++ptr];
-            }
+    // Connecting only counts once the server sends the deal again, a server
+    // closing the connection before that uses up the attempts.
+    while (reconnect_attempt < reconnect_attempts) {
+        int64_t delay = reconnect_delay_ms(reconnect_attempt++);
+        struct timespec ts = {delay / 1000, (delay % 1000) * 1000000};
+        nanosleep(&ts, NULL);
 
-            if(!is_automatic) {
-                user_interface(msg);
-            }
-            free(msg);
-            return 0;
-        } else {
-            free(msg);
-            return get_game_info(socket_fd);
+        int socket_fd = try_connection(hostname, port);
+        if (socket_fd < 0) {
+            continue;
         }
-        
+        player_reconnected(&player, socket_fd);
+        if (introduce(&player, &ring)) {
+            return;
+        }
+        ring_free(&ring);
+        close(socket_fd);
     }
+    fatal("Connection closed in the middle of the deal");
 }
 
-// Function to exchange initial data with the server.
-static int handshake(int socket_fd) {
-    // Preparing and sending IAM message.
-    size_t msg_len = IAM_LEN;
-    char *msg = malloc((msg_len + 1) * sizeof(char));
-    if (msg == NULL) {
-        syserr("malloc");
+// Processes all complete messages received from the server.
+static void handle_server_input() {
+    int socket_fd = player.fd;
+    ssize_t read_length = receive(&player, &ring);
+    if (read_length < 0 && errno == EAGAIN) {
+        return;
     }
-    memset(msg, 0, (msg_len + 1) * sizeof(char));
-    strcpy(msg, "IAM");
-    msg[strlen(msg)] = game_side;
-    strcat(msg, "\r\n");
-
-    if(is_automatic) {
-        raport(socket_fd, msg, false);
+    if (read_length <= 0) {
+        connection_closed();
+        return;
     }
 
-    ssize_t written_length = writen(socket_fd, msg, msg_len);
-    if (written_length < 0) {
-        syserr("writen");
-    }
-    else if ((size_t) written_length != msg_len) {
-        fatal("incomplete writen");
-    }
-    free(msg);
-
-    return get_game_info(socket_fd);
-}
-
-// Converts card number to proper array index (automatic play).
-static int numtoi(char num) {
-    if (num == '1') {
-        return 8;
-    } else if (num == 'J') {
-        return 9;
-    } else if (num == 'Q') {
-        return 10;
-    } else if (num == 'K') {
-        return 11;
-    } else if (num == 'A') {
-        return 12;
-    } else {
-        return num - '0' - 2;
-    }
-}
-
-// Plays out the hand automatically.
-static void auto_play(int socket_fd) {
     char *msg;
     size_t msg_len;
-    bool correct_packet;
-
-    // Playing out all tricks.
-    for (int t = 1; t <= NO_CARDS; t++) {
-        // Read info about the current trick.
-        correct_packet = false;
-        while (!correct_packet) {
-            msg = read_msg(socket_fd);
-            msg_len = strlen(msg);
-
-            if (is_automatic) {
-                raport(socket_fd, msg, true);
-            }
-
-            if (msg_len < 2 || msg[msg_len - 2] != '\r' || 
-                msg[msg_len - 1] != '\n') {
-                free(msg);
-            } else if (strncmp(msg, "TRICK", 5) == 0) {
-                int trick_numer = msg[strlen("TRICK")] - '0';
-                if (t >= 10) {
-                    trick_numer *= 10;
-                    trick_numer += msg[strlen("TRICK") + 1] - '0';
-                }
-                if (trick_numer != t) {
-                    free(msg);
-                } else {
-                correct_packet = true;
-                }
-            } else {
-                free(msg);
-            }
-        }
-
-        // Pick a card to play. Strategy is to always play the lowest if
-        // possible to win and the highest otherwise.
-        
-        card_t laid_cards[3]; // Max number of cards in a trick.
-        // Fill info about the cards in trick.
-        int ptr = 5; // Msg after "TRICK".
-        char trick_char = msg[ptr++];
-        char trick_second_char;
-        if (t >= 10) {
-            trick_second_char = msg[ptr++];
-        }
-        int card = 0;
-        while (msg[ptr]!= '\r') {
-            laid_cards[card].num = msg[ptr++];
-            if (msg[ptr] == '0') {
-                ptr++;
-            }
-            laid_cards[card].col = msg[ptr++];
-            card++;
-        }
-        free(msg);
-        
-        card_t card_to_play;
-        card_to_play.num = 0;
-        card_to_play.col = 0;
-        int card_id = -1;
-        if (card == 0) { // No cards in the trick. We pick lowest possible card.
-            for(int i = 0; i < NO_CARDS; i++) {
-                if (cards[i].num == 0) {
-                    continue;
-                } else if (card_to_play.num == 0) {
-                    card_to_play = cards[i];
-                    card_id = i;
-                } else if (numtoi(cards[i].num) < numtoi(card_to_play.num)) {
-                    card_to_play = cards[i];
-                    card_id = i;
-                }
-            }
-        } else {
-            // Find the highest card in the trick.
-            card_t highest_card = laid_cards[0];
-            for (int i = 1; i < card; i++) {
-                if (highest_card.col == laid_cards[i].col && 
-                    numtoi(laid_cards[i].num) > numtoi(highest_card.num)) {
-                    highest_card = laid_cards[i];
-                }
-            }
-            // Chceck if we can play lower card.
-            for (int i = 0; i < NO_CARDS; i++) {
-                if (cards[i].num == 0) {
-                    continue;
-                } else if (cards[i].col == highest_card.col && 
-                    numtoi(cards[i].num) < numtoi(highest_card.num)) {
-                    card_to_play = cards[i];
-                    card_id = i;
-                }
-            }
-            if (card_id == -1) {
-                // If we can't play lower card, we play the highest card.
-                for (int i = 0; i < NO_CARDS; i++) {
-                    if (cards[i].num == 0) {
-                        continue;
-                    } else if (card_to_play.num == 0) {
-                        card_to_play = cards[i];
-                        card_id = i;
-                    } else if (numtoi(cards[i].num) > numtoi(card_to_play.num)) {
-                        card_to_play = cards[i];
-                        card_id = i;
-                    }
-                }
+    char reply[BUF_SIZE];
+    char text[BUF_SIZE];
+    while ((msg = frame_next(&player.in, &msg_len)) != NULL) {
+        if (player.compact) {
+            if (compact_decode(text, (uint8_t const *) msg, msg_len) == 0) {
+                continue;
             }
+            msg = text;
         }
-
-        // Send card info to the server.
-        msg_len = TRICK_LEN;
-        if (card_to_play.num == '1') {
-            msg_len++;
-        }
-        if (t >= 10) {
-            msg_len++;
-        }
-        msg = malloc((msg_len + 1) * sizeof(char));
-        if (msg == NULL) {
-            syserr("malloc");
-        }
-        memset(msg, 0, (msg_len + 1) * sizeof(char));
-        strcpy(msg, "TRICK");
-        msg[strlen(msg)] = trick_char;
-        if (t >= 10) {
-            msg[strlen(msg)] = trick_second_char;
-        }
-        msg[strlen(msg)] = card_to_play.num;
-        if (card_to_play.num == '1') {
-            msg[strlen(msg)] = '0';
-        }
-        msg[strlen(msg)] = card_to_play.col;
-        strcat(msg, "\r\n");
-
         if (is_automatic) {
-            raport(socket_fd, msg, false);
+            raport(socket_fd, msg, true);
         }
+        PROBE2(msg_recv, socket_fd, msg);
 
-        ssize_t written_length = writen(socket_fd, msg, msg_len);
-        if (written_length < 0) {
-            syserr("writen");
-        }
-        else if ((size_t) written_length != msg_len) {
-            fatal("incomplete writen");
+        int trick_before = player.trick_num;
+        ssize_t reply_len = player_handle_msg(&player, msg, reply);
+        if (!is_automatic) {
+            user_interface(msg, trick_before);
         }
-        free(msg);
-
-        cards[card_id].num = 0;
-        cards[card_id].col = 0;
-
-        // Receive info about who took the trick.
-        correct_packet = false;
-        while (!correct_packet) {
-            msg = read_msg(socket_fd);
-            msg_len = strlen(msg);
-
-            if (is_automatic) {
-                raport(socket_fd, msg, true);
-            }
 
-            if (msg_len < 2 || msg[msg_len - 2] != '\r' || 
-                msg[msg_len - 1] != '\n') {
-                free(msg);
-            } else if (strncmp(msg, "TAKEN", 5) == 0) {
-                correct_packet = true;
-            } else {
-                free(msg);
-            }
+        if (reply_len < 0) {
+            // The place is busy.
+            close(socket_fd);
+            exit(1);
+        } else if (reply_len > 0 && !send_msg(socket_fd, &ring, reply, reply_len, player.compact)) {
+            // Whatever is left will be read before noticing the end.
+            break;
         }
-        free(msg);
     }
-
-    // Receive info about who won the hand.
-    correct_packet = false;
-    while (!correct_packet) {
-        msg = read_msg(socket_fd);
-        msg_len = strlen(msg);
-
-        if (is_automatic) {
-           raport(socket_fd, msg, true);
-        }
-
-        if (msg_len < 2 || msg[msg_len - 2] != '\r' || 
-            msg[msg_len - 1] != '\n') {
-            free(msg);
-        } else if (strncmp(msg, "SCORE", 5) == 0) {
-            correct_packet = true;
-        } else {
-            free(msg);
-        }
+    if (!player.resuming) {
+        reconnect_attempt = 0;
     }
-    free(msg);
 
-    // Receive info about total amount of points.
-    correct_packet = false;
-    while (!correct_packet) {
-        msg = read_msg(socket_fd);
-        msg_len = strlen(msg);
-
-        if (is_automatic) {
-           raport(socket_fd, msg, true);
-        }
-
-        if (msg_len < 2 || msg[msg_len - 2] != '\r' || 
-            msg[msg_len - 1] != '\n') {
-            free(msg);
-        } else if (strncmp(msg, "TOTAL", 5) == 0) {
-            correct_packet = true;
-        } else {
-            free(msg);
-        }
+    // The ring may hold more than the buffer took, and there will be no
+    // wakeup for it.
+    if (ring.shared != NULL && player.in.end == BUF_SIZE) {
+        handle_server_input();
     }
-    free(msg);
 }
 
-static void handle_user_input(int socket_fd, char *msg) {
+// Function to handle a command from the user.
+static void handle_user_input(char *msg) {
     if (strcmp(msg, "cards\n") == 0) {
-        bool first = true;
-        for (int i = 0; i < NO_CARDS; i++) {
-            if (cards[i].num == 0) {
-                continue;
-            }
-            if (!first) {
-                printf(", ");
-            }
-            first = false;
-            printf("%c", cards[i].num);
-            if (cards[i].num == '1') {
-                printf("0");
-            }
-            printf("%c", cards[i].col);
-        }
+        print_cards(player.cards, NO_CARDS);
         printf("\n");
     } else if (strcmp(msg, "tricks\n") == 0) {
-        for (int i = 0; i < message_num; i++) {
-            if (tricks[i][0].num == 0) {
-                break;
-            }
-            for (int j = 0; j < NO_PLAYERS; j++) {
-                printf("%c", tricks[i][j].num);
-                if (tricks[i][j].num == '1') {
-                    printf("0");
-                }
-                printf("%c", tricks[i][j].col);
-                if (j < NO_PLAYERS - 1) {
-                    printf(", ");
-                }
-            }
+        for (int i = 0; i < player.trick_num - 1; i++) {
+            print_cards(player.tricks[i], NO_PLAYERS);
             printf("\n");
         }
     } else if (strncmp(msg, "!", 1) == 0) {
         // Parse the card.
         card_t card_to_play;
-        size_t ptr = 1;
-        card_to_play.num = msg[ptr++];
-        if (msg[ptr] == '0') {
-            ptr++;
-        }
-        card_to_play.col = msg[ptr++];
-        if (msg[ptr] != '\n' || ptr != strlen(msg) - 1) {
+        size_t card_len = parse_card(msg + 1, &card_to_play);
+        if (card_len == 0 || strcmp(msg + 1 + card_len, "\n") != 0) {
             printf("Wrong card format\n");
             return;
         }
-        card_played.num = card_to_play.num;
-        card_played.col = card_to_play.col;
-
-        // Create the message.
-        char *to_send = malloc(BUF_SIZE * sizeof(char));
-        memset(to_send, 0, BUF_SIZE * sizeof(char));
-        strcpy(to_send, "TRICK");
-        char num[15];
-        sprintf(num, "%d", message_num + 1);
-        strcat(to_send, num);
-        to_send[strlen(to_send)] = card_to_play.num;
-        if (card_to_play.num == '1') {
-            to_send[strlen(to_send)] = '0';
-        }
-        to_send[strlen(to_send)] = card_to_play.col;
-        strcat(to_send, "\r\n");
 
         // Send the message.
-        ssize_t written_length = writen(socket_fd, to_send, strlen(to_send));
-        if (written_length < 0) {
-            syserr("writen");
-        }
-        else if ((size_t) written_length != strlen(to_send)) {
-            fatal("incomplete writen");
+        char to_send[BUF_SIZE];
+        size_t to_send_len = player_play(&player, card_to_play, to_send);
+        if (!send_msg(player.fd, &ring, to_send, to_send_len, player.compact)) {
+            printf("Connection to the server is broken\n");
         }
-        free(to_send);
     } else {
         printf("Unknown command\n");
     }
 }
 
-static void handle_server_input(char *msg) {
-    if (message_num <= 12) {
-        // We are playing out one of the tricks.
-        // We are expecting a TRICK, WRONG, or TAKEN message.
-        if (strncmp(msg, "TRICK", 5) == 0) {
-            user_interface(msg);
-        } else if (strncmp(msg, "WRONG", 5) == 0) {
-            user_interface(msg);
-            card_played.num = 0;
-            card_played.col = 0;
-        } else if (strncmp(msg, "TAKEN", 5) == 0) {
-            user_interface(msg);
-
-            // Update tricks.
-            size_t ptr = strlen("TAKEN") + (message_num >= 9 ? 2 : 1);
-            for (int i = 0; i < NO_PLAYERS; i++) {
-                tricks[message_num][i].num = msg[ptr++];
-                if (msg[ptr] == '0') {
-                    ptr++;
-                }
-                tricks[message_num][i].col = msg[ptr++];
-            }
-
-            // Update cards.
-            for (int i = 0; i < NO_CARDS; i++) {
-                if (cards[i].num == card_played.num && cards[i].col == card_played.col) {
-                    cards[i].num = 0;
-                    cards[i].col = 0;
-                    card_played.num = 0;
-                    card_played.col = 0;
-                    break;
-                }
-            }
-            message_num++;
-        }
-    } else if (message_num == 13) {
-        // We are expecting a SCORE message.
-        if (strncmp(msg, "SCORE", 5) == 0) {
-            user_interface(msg);
-            message_num++;
-        }
-    } else if (message_num == 14) {
-        // We are expecting a TOTAL message.
-        if (strncmp(msg, "TOTAL", 5) == 0) {
-            user_interface(msg);
-            is_finished = true;
+// Plays automatically on one seat.
+static void auto_play() {
+    int64_t spin_ns = busy_poll_us * INT64_C(1000);
+    while (true) {
+        if (ring.shared != NULL) {
+            ring_wait(&ring, spin_ns);
+        } else if (spin_ns > 0) {
+            struct pollfd fd = {.fd = player.fd, .events = POLLIN};
+            poll_spin(&fd, 1, -1, spin_ns);
         }
+        handle_server_input();
     }
 }
 
-
-static void manual_play(int socket_fd) {
-    // Initialize game data.
-    message_num = 0;
-    for (int i = 0; i < NO_CARDS + 6; i++) {
-        for (int j = 0; j < NO_PLAYERS; j++) {
-            tricks[i][j].num = 0;
-            tricks[i][j].col = 0;
-        }
-    }
-    is_finished = false;
+// Lets the user play on one seat.
+static void manual_play() {
     // Setting up poll
     struct pollfd fds[2];
 
     // Monitor socket for input
-    fds[0].fd = socket_fd;
     fds[0].events = POLLIN;
 
     // Monitor stdin for input
@@ -773,24 +557,23 @@ static void manual_play(int socket_fd) {
 
     char buffer[BUF_SIZE];
 
-    while (!is_finished) {
+    while (true) {
+        fds[0].fd = player.fd; // Changes after reconnecting.
         int ret = poll(fds, 2, -1); // Wait indefinitely for an event
         if (ret < 0) {
             syserr("poll");
         }
 
         // Check for server input
-        if (fds[0].revents & POLLIN) {
-            char *msg = read_msg(socket_fd);
-            handle_server_input(msg);
-            free(msg);
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            handle_server_input();
         }
 
         // Check for console input
         if (fds[1].revents & POLLIN) {
             memset(buffer, 0, BUF_SIZE);
             if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-                handle_user_input(socket_fd, buffer);
+                handle_user_input(buffer);
             } else {
                 // End of input or error
                 if (feof(stdin)) {
@@ -804,33 +587,221 @@ static void manual_play(int socket_fd) {
     }
 }
 
+// Function to connect a seat of the multi-seat mode and introduce it to
+// the server. Returns false if the server is unreachable.
+static bool connect_seat(seat_t *seat, int epoll_fd) {
+    int socket_fd = try_connection(hostnames[seat->host], ports[seat->host]);
+    if (socket_fd < 0) {
+        return false;
+    }
+    player_reconnected(&seat->player, socket_fd);
+    if (!introduce(&seat->player, &seat->ring)) {
+        ring_free(&seat->ring);
+        close(socket_fd);
+        return false;
+    }
 
-int main(int argc, char *argv[]) {
-    parse_args(argc, argv);
-    
-    int socket_fd = prepare_connection();
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = seat;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+        syserr("epoll_ctl");
+    }
+    seat->retry_at = 0;
+    return true;
+}
 
-    handshake(socket_fd);
+// Function to handle what the server sent to a seat of the multi-seat mode.
+// If the connection ends, the seat waits to connect again or is done.
+static void handle_seat(seat_t *seat, size_t *active_players, size_t *waiting_players) {
+    player_t *p = &seat->player;
+    ssize_t read_length = receive(p, &seat->ring);
+    if (read_length < 0 && errno == EAGAIN) {
+        return;
+    }
+    bool finished = read_length <= 0;
+    bool busy = false;
+
+    char *in_msg;
+    size_t in_len;
+    char text[BUF_SIZE];
+    char msg[BUF_SIZE];
+    while (!finished && (in_msg = frame_next(&p->in, &in_len)) != NULL) {
+        if (p->compact) {
+            if (compact_decode(text, (uint8_t const *) in_msg, in_len) == 0) {
+                continue;
+            }
+            in_msg = text;
+        }
+        raport(p->fd, in_msg, true);
+        PROBE2(msg_recv, p->fd, in_msg);
 
-    while (true) {
-        if (is_automatic) {
-            auto_play(socket_fd);
+        ssize_t msg_len = player_handle_msg(p, in_msg, msg);
+        if (msg_len < 0) {
+            finished = true;
+            busy = true;
+        } else if (msg_len > 0 && !send_msg(p->fd, &seat->ring, msg, msg_len, p->compact)) {
+            finished = true;
+        }
+    }
+
+    if (!p->resuming) {
+        seat->attempts = 0;
+    }
+
+    if (finished) {
+        ring_free(&seat->ring);
+        close(p->fd); // Also removes the socket from epoll.
+        if (p->resuming) {
+            // Closed before the deal was sent again, the connection failed.
+            seat->attempts++;
+        }
+        if (!busy && p->state != PLAYER_IDLE && seat->attempts < reconnect_attempts) {
+            // Broken in the middle of the deal, take the place again.
+            seat->retry_at = current_time_ms() + reconnect_delay_ms(seat->attempts);
+            (*waiting_players)++;
         } else {
-            manual_play(socket_fd);
+            if (!busy && p->state != PLAYER_IDLE) {
+                error("Cannot connect again on place %c", p->seat);
+            }
+            (*active_players)--;
         }
+    } else if (seat->ring.shared != NULL && p->in.end == BUF_SIZE) {
+        // The ring may hold more than the buffer took, and there will be no
+        // wakeup for it.
+        handle_seat(seat, active_players, waiting_players);
+    }
+}
 
-        // Check if there is more data available.
-        char *temp = malloc(sizeof(char) * 2);
-        ssize_t read_length = recv(socket_fd, temp, 1, MSG_PEEK);
-        if (read_length < 0) {
-            syserr("recv");
-        } else if (read_length == 0) {
-            free(temp);
-            close(socket_fd);
-            exit(0);
+// Same as epoll_wait(), but spins first like poll_spin().
+static int epoll_wait_spin(int epoll_fd, struct epoll_event *events, int max_events, int timeout) {
+    if (busy_poll_us > 0 && timeout != 0) {
+        int64_t spin_end = monotonic_ns() + busy_poll_us * INT64_C(1000);
+        do {
+            int ret = epoll_wait(epoll_fd, events, max_events, 0);
+            if (ret != 0) {
+                return ret;
+            }
+        } while (monotonic_ns() < spin_end);
+    }
+    return epoll_wait(epoll_fd, events, max_events, timeout);
+}
+
+// Plays on many seats at once, driving all connections from one epoll loop.
+static void multi_seat_play() {
+    size_t no_seats = strlen(seat_list);
+    size_t no_players = (size_t) no_hostnames * no_seats * seat_repeat;
+    seat_t *seats = malloc(no_players * sizeof(seat_t));
+    if (seats == NULL) {
+        syserr("malloc");
+    }
+
+    // Every seat needs its own descriptor, so use as many as we are allowed.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        syserr("epoll_create1");
+    }
+
+    // Connect all the players and introduce them to the servers.
+    strategy_t const *strategy = find_strategy("duck");
+    size_t seat_id = 0;
+    for (int h = 0; h < no_hostnames; h++) {
+        for (size_t r = 0; r < seat_repeat; r++) {
+            for (size_t s = 0; s < no_seats; s++) {
+                seat_t *seat = &seats[seat_id++];
+                player_init(&seat->player, -1, seat_list[s], strategy);
+                if (compact) {
+                    player_use_compact(&seat->player);
+                }
+                seat->host = h;
+                seat->attempts = 0;
+                seat->ring.shared = NULL;
+                if (!connect_seat(seat, epoll_fd)) {
+                    syserr("cannot connect to the server");
+                }
+            }
         }
-        free(temp);
+    }
 
-        get_game_info(socket_fd);
+    // Play until all servers close the connections.
+    size_t active_players = no_players;
+    size_t waiting_players = 0; // Waiting to connect again.
+    struct epoll_event events[MAX_EVENTS];
+    while (active_players > 0) {
+        // Connect again the players whose time has come.
+        int64_t now = current_time_ms();
+        int64_t next_retry = -1;
+        for (size_t i = 0; i < no_players && waiting_players > 0; i++) {
+            seat_t *seat = &seats[i];
+            if (seat->retry_at == 0) {
+                continue;
+            } else if (seat->retry_at <= now) {
+                if (connect_seat(seat, epoll_fd)) {
+                    waiting_players--;
+                    continue;
+                } else if (++seat->attempts >= reconnect_attempts) {
+                    error("Cannot connect again on place %c", seat->player.seat);
+                    seat->retry_at = 0;
+                    waiting_players--;
+                    active_players--;
+                    continue;
+                }
+                seat->retry_at = now + reconnect_delay_ms(seat->attempts);
+            }
+            if (next_retry == -1 || seat->retry_at < next_retry) {
+                next_retry = seat->retry_at;
+            }
+        }
+        if (active_players == 0) {
+            break;
+        }
+
+        int wait_ms = next_retry == -1 ? -1 : (int) (next_retry - now);
+        int ret = epoll_wait_spin(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (ret < 0) {
+            syserr("epoll_wait");
+        }
+
+        for (int e = 0; e < ret; e++) {
+            handle_seat(events[e].data.ptr, &active_players, &waiting_players);
+        }
     }
-}
\ No newline at end of file
+
+    close(epoll_fd);
+    free(seats);
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    if (pinned_cpu != -1) {
+        pin_to_cpu(pinned_cpu);
+    }
+
+    if (seat_list != NULL) {
+        multi_seat_play();
+        return 0;
+    }
+
+    int socket_fd = prepare_connection(hostname, port);
+    player_init(&player, socket_fd, game_side, is_automatic ? find_strategy("duck") : NULL);
+    if (compact) {
+        player_use_compact(&player);
+    }
+
+    // Introduce ourselves to the server.
+    if (!introduce(&player, &ring)) {
+        syserr("cannot introduce to the server");
+    }
+
+    if (is_automatic) {
+        auto_play();
+    } else {
+        manual_play();
+    }
+}
@@ -0,0 +1,295 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "err.h"
+#include "common.h"
+#include "player.h"
+#include "strategy.h"
+#include "hdr.h"
+
+#define MAX_EVENTS 256
+#define NS_IN_SEC INT64_C(1000000000)
+#define NS_IN_USEC INT64_C(1000)
+#define HIGHEST_LATENCY (60 * NS_IN_SEC)
+
+// Struct to store an automatic player with its measurements.
+typedef struct load_player_t {
+    player_t player;
+    bool connected;
+    int64_t trick_time; // When the TRICK to be taken arrived, 0 if none.
+    int trick_num;      // Number of that trick.
+} load_player_t;
+
+// Command line arguments.
+uint16_t port = 0;
+int family = AF_UNSPEC;
+size_t no_players = NO_PLAYERS;
+double start_rate = 100;
+double rate_step = 0;
+time_t duration = 0;
+int64_t expected_interval = 0;
+
+// Measurements.
+hdr_hist_t reply_latency;
+hdr_hist_t taken_latency;
+uint64_t msgs_in = 0;
+uint64_t msgs_out = 0;
+uint64_t totals_received = 0;
+uint64_t connect_errors = 0;
+
+// Function to parse command line arguments.
+static void parse_args(int argc, char *argv[]) {
+    bool port_set = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-4") == 0) {
+            family = AF_INET;
+            continue;
+        } else if (strcmp(argv[i], "-6") == 0) {
+            family = AF_INET6;
+            continue;
+        }
+        if (i + 1 == argc) {
+            fatal("Missing value of %s", argv[i]);
+        }
+        if (strcmp(argv[i], "-p") == 0) {
+            port = read_port(argv[i + 1]);
+            port_set = true;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            no_players = read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            start_rate = (double) read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-R") == 0) {
+            rate_step = (double) read_size(argv[i + 1]);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            duration = read_time(argv[i + 1]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            expected_interval = (int64_t) read_size(argv[i + 1]) * NS_IN_USEC;
+        } else {
+            fatal("Invalid argument: %s", argv[i]);
+        }
+        i++;
+    }
+    if (!port_set) {
+        fatal("Missing obligatory argument");
+    }
+    if (start_rate <= 0 && rate_step <= 0) {
+        fatal("Connection rate must be positive");
+    }
+}
+
+// Function to get current time in nanoseconds.
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NS_IN_SEC + ts.tv_nsec;
+}
+
+// Function to connect to the server on the loopback interface.
+static int prepare_connection(struct sockaddr_storage *server_address) {
+    int socket_fd = socket(server_address->ss_family, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        syserr("cannot create a socket");
+    }
+
+    if (connect(socket_fd, (struct sockaddr *) server_address,
+                (socklen_t) sizeof(*server_address)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+// Function to send a message, returns false if the connection is broken.
+static bool send_msg(int socket_fd, char const *msg, size_t msg_len) {
+    ssize_t written_length = writen(socket_fd, msg, msg_len);
+    if (written_length < 0 || (size_t) written_length != msg_len) {
+        return false;
+    }
+    msgs_out++;
+    return true;
+}
+
+// Processes messages received by a player. Returns false if the player is done.
+static bool handle_input(load_player_t *player, int64_t received_time) {
+    ssize_t read_length = frame_fill(&player->player.in, player->player.fd);
+    if (read_length <= 0) {
+        return false;
+    }
+
+    char reply[BUF_SIZE];
+    char *msg;
+    size_t msg_len;
+    while ((msg = frame_next(&player->player.in, &msg_len)) != NULL) {
+        msgs_in++;
+
+        if (strncmp(msg, "TAKEN", 5) == 0 && player->trick_time != 0 &&
+            player->player.trick_num == player->trick_num) {
+            hdr_record_corrected(&taken_latency, received_time - player->trick_time,
+                expected_interval);
+            player->trick_time = 0;
+        } else if (strncmp(msg, "TOTAL", 5) == 0) {
+            totals_received++;
+        }
+
+        ssize_t reply_len = player_handle_msg(&player->player, msg, reply);
+        if (reply_len < 0) {
+            return false;
+        } else if (reply_len > 0) {
+            if (!send_msg(player->player.fd, reply, reply_len)) {
+                return false;
+            }
+            hdr_record_corrected(&reply_latency, now_ns() - received_time,
+                expected_interval);
+            // A retransmitted TRICK doesn't restart the measurement.
+            if (player->trick_time == 0 || player->trick_num != player->player.trick_num) {
+                player->trick_time = received_time;
+                player->trick_num = player->player.trick_num;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    struct sockaddr_storage server_address = get_server_address("localhost", port, family);
+
+    // Every player needs its own descriptor, so use as many as we are allowed.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    load_player_t *players = calloc(no_players, sizeof(load_player_t));
+    if (players == NULL) {
+        syserr("calloc");
+    }
+    hdr_init(&reply_latency, HIGHEST_LATENCY, 3);
+    hdr_init(&taken_latency, HIGHEST_LATENCY, 3);
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        syserr("epoll_create1");
+    }
+
+    int64_t start_time = now_ns();
+    int64_t report_time = start_time + NS_IN_SEC;
+    uint64_t last_msgs = 0;
+    uint64_t last_totals = 0;
+    size_t opened = 0;
+    size_t active = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (opened < no_players || active > 0) {
+        int64_t now = now_ns();
+        double elapsed = (double) (now - start_time) / NS_IN_SEC;
+        if (duration > 0 && elapsed >= duration) {
+            break;
+        }
+
+        // Open the connections due by now. Players get seats in NESW order,
+        // so every four consecutive connections can fill one table.
+        double due = start_rate * elapsed + rate_step * elapsed * elapsed / 2;
+        while (opened < no_players && (double) opened < due) {
+            load_player_t *player = &players[opened];
+            char seat = "NESW"[opened % NO_PLAYERS];
+            opened++;
+
+            int socket_fd = prepare_connection(&server_address);
+            if (socket_fd < 0) {
+                connect_errors++;
+                continue;
+            }
+            player_init(&player->player, socket_fd, seat, find_strategy("duck"));
+            player->connected = true;
+
+            char msg[BUF_SIZE];
+            if (!send_msg(socket_fd, msg, player_iam(&player->player, msg))) {
+                close(socket_fd);
+                player->connected = false;
+                continue;
+            }
+
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = player;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+                syserr("epoll_ctl");
+            }
+            active++;
+        }
+
+        // Wait shortly while still ramping up, otherwise until the next report.
+        // A report overdue already doesn't make the wait infinite.
+        int wait_ms = opened < no_players ? 1 : (int) ((report_time - now) / 1000000) + 1;
+        if (wait_ms < 0) {
+            wait_ms = 0;
+        }
+        int ret = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("epoll_wait");
+        }
+
+        int64_t received_time = now_ns();
+        for (int e = 0; e < ret; e++) {
+            load_player_t *player = events[e].data.ptr;
+            if (!handle_input(player, received_time)) {
+                close(player->player.fd); // Also removes the socket from epoll.
+                player->connected = false;
+                active--;
+            }
+        }
+
+        // Print statistics every second.
+        if (received_time >= report_time) {
+            double interval = (double) (received_time - report_time + NS_IN_SEC) / NS_IN_SEC;
+            uint64_t msgs = msgs_in + msgs_out;
+            printf("%6.1fs connections %zu games/s %.1f msgs/s %.0f\n",
+                (double) (received_time - start_time) / NS_IN_SEC, active,
+                (double) (totals_received - last_totals) / NO_PLAYERS / interval,
+                (double) (msgs - last_msgs) / interval);
+            fflush(stdout);
+            last_msgs = msgs;
+            last_totals = totals_received;
+            report_time = received_time + NS_IN_SEC;
+        }
+    }
+
+    // Print the summary.
+    double elapsed = (double) (now_ns() - start_time) / NS_IN_SEC;
+    printf("total %.2fs connections %zu errors %" PRIu64 " games %.0f (%.1f/s) "
+        "msgs %" PRIu64 " (%.0f/s)\n", elapsed, opened, connect_errors,
+        (double) totals_received / NO_PLAYERS, (double) totals_received / NO_PLAYERS / elapsed,
+        msgs_in + msgs_out, (double) (msgs_in + msgs_out) / elapsed);
+    hdr_print(stdout, "TRICK->reply", &reply_latency);
+    hdr_print(stdout, "TRICK->TAKEN", &taken_latency);
+
+    for (size_t i = 0; i < opened; i++) {
+        if (players[i].connected) {
+            close(players[i].player.fd);
+        }
+    }
+    close(epoll_fd);
+    hdr_free(&reply_latency);
+    hdr_free(&taken_latency);
+    free(players);
+}
@@ -0,0 +1,308 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#include "err.h"
+#include "common.h"
+#include "hdr.h"
+
+#define MAX_EVENTS 256
+#define NS_IN_SEC INT64_C(1000000000)
+#define NS_IN_MSEC INT64_C(1000000)
+#define HIGHEST_LATENCY (60 * NS_IN_SEC)
+#define STALL_TIMEOUT NS_IN_SEC // How long an event waits for its messages.
+
+// Struct to store one entry of the recording.
+typedef struct replay_event_t {
+    int64_t time;    // Nanoseconds since the start of the recording.
+    size_t conn_id;
+    char kind;       // 'c' (connect), 'm' (message) or 'd' (disconnect).
+    uint64_t after;  // Messages the connection had got before the event.
+    char *msg;
+    size_t len;
+} replay_event_t;
+
+// Struct to store a connection to the server.
+typedef struct replay_conn_t {
+    int fd;            // -1 if not connected.
+    bool closed;       // Closed by us or by the server.
+    uint64_t received; // Complete messages received.
+    bool after_cr;     // The last byte received was '\r'.
+    int64_t sent_time; // When the last message was sent, 0 if answered.
+} replay_conn_t;
+
+// Command line arguments.
+char const *host = "localhost";
+uint16_t port = 0;
+int family = AF_UNSPEC;
+char const *recording_file = NULL;
+bool fast = false;
+
+// Recording and connections.
+replay_event_t *events = NULL;
+size_t no_events = 0;
+replay_conn_t *conns = NULL;
+size_t no_conns = 0;
+size_t open_conns = 0;
+int epoll_fd;
+
+// Measurements.
+hdr_hist_t reply_latency;
+uint64_t msgs_in = 0;
+uint64_t msgs_out = 0;
+uint64_t stalls = 0;
+
+// Function to parse command line arguments.
+static void parse_args(int argc, char *argv[]) {
+    bool port_set = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-4") == 0) {
+            family = AF_INET;
+            continue;
+        } else if (strcmp(argv[i], "-6") == 0) {
+            family = AF_INET6;
+            continue;
+        } else if (strcmp(argv[i], "-F") == 0) {
+            fast = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            fatal("Missing value of %s", argv[i]);
+        }
+        if (strcmp(argv[i], "-h") == 0) {
+            host = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            port = read_port(argv[i + 1]);
+            port_set = true;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            recording_file = argv[i + 1];
+        } else {
+            fatal("Invalid argument: %s", argv[i]);
+        }
+        i++;
+    }
+    if (!port_set || recording_file == NULL) {
+        fatal("Missing obligatory argument");
+    }
+}
+
+// Function to get current time in nanoseconds.
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * NS_IN_SEC + ts.tv_nsec;
+}
+
+// Function to read the recording written by kierki-serwer -R.
+static void load_recording(char const *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        syserr("fopen %s", path);
+    }
+
+    size_t capacity = 0;
+    replay_event_t event;
+    while (fscanf(file, "%" SCNd64 " %zu %c %" SCNu64 " %zu", &event.time, &event.conn_id,
+                  &event.kind, &event.after, &event.len) == 5) {
+        event.msg = malloc(event.len + 1);
+        if (event.msg == NULL) {
+            syserr("malloc");
+        }
+        if (fgetc(file) != '\n' || fread(event.msg, 1, event.len, file) != event.len ||
+            fgetc(file) != '\n') {
+            // The server was killed while writing the entry.
+            free(event.msg);
+            break;
+        }
+        event.msg[event.len] = '\0';
+
+        if (no_events == capacity) {
+            capacity = capacity == 0 ? 1024 : 2 * capacity;
+            events = realloc(events, capacity * sizeof(replay_event_t));
+            if (events == NULL) {
+                syserr("realloc");
+            }
+        }
+        events[no_events++] = event;
+        if (event.conn_id >= no_conns) {
+            no_conns = event.conn_id + 1;
+        }
+    }
+    fclose(file);
+
+    conns = calloc(no_conns, sizeof(replay_conn_t));
+    if (conns == NULL && no_conns > 0) {
+        syserr("calloc");
+    }
+    for (size_t i = 0; i < no_conns; i++) {
+        conns[i].fd = -1;
+    }
+}
+
+// Function to close the connection.
+static void close_conn(replay_conn_t *conn) {
+    if (conn->fd != -1) {
+        close(conn->fd); // Also removes the socket from epoll.
+        conn->fd = -1;
+        open_conns--;
+    }
+    conn->closed = true;
+}
+
+// Function to play one event of the recording.
+static void play_event(replay_event_t const *event, struct sockaddr_storage *server_address) {
+    replay_conn_t *conn = &conns[event->conn_id];
+    if (event->kind == 'c') {
+        int socket_fd = socket(server_address->ss_family, SOCK_STREAM, 0);
+        if (socket_fd < 0) {
+            syserr("cannot create a socket");
+        }
+        if (connect(socket_fd, (struct sockaddr *) server_address,
+                    (socklen_t) sizeof(*server_address)) < 0) {
+            syserr("cannot connect to the server");
+        }
+        conn->fd = socket_fd;
+        open_conns++;
+
+        struct epoll_event epoll_event;
+        epoll_event.events = EPOLLIN;
+        epoll_event.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &epoll_event) < 0) {
+            syserr("epoll_ctl");
+        }
+    } else if (conn->fd == -1) {
+        // The server has already closed the connection.
+    } else if (event->kind == 'm') {
+        ssize_t written_length = writen(conn->fd, event->msg, event->len);
+        if (written_length < 0 || (size_t) written_length != event->len) {
+            close_conn(conn);
+            return;
+        }
+        msgs_out++;
+        conn->sent_time = now_ns();
+    } else {
+        close_conn(conn);
+    }
+}
+
+// Function to receive what the server sent on the connection.
+static void handle_input(replay_conn_t *conn, int64_t received_time) {
+    char buffer[BUF_SIZE];
+    ssize_t read_length = read(conn->fd, buffer, sizeof(buffer));
+    if (read_length <= 0) {
+        close_conn(conn);
+        return;
+    }
+
+    for (ssize_t i = 0; i < read_length; i++) {
+        if (conn->after_cr && buffer[i] == '\n') {
+            conn->received++;
+            msgs_in++;
+            if (conn->sent_time != 0) {
+                hdr_record(&reply_latency, received_time - conn->sent_time);
+                conn->sent_time = 0;
+            }
+        }
+        conn->after_cr = buffer[i] == '\r';
+    }
+}
+
+// Function to check if the event can be played: its connection has got all
+// the messages the server had sent before the event was recorded.
+static bool is_ready(replay_event_t const *event) {
+    replay_conn_t const *conn = &conns[event->conn_id];
+    return event->kind == 'c' || conn->closed || conn->received >= event->after;
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    load_recording(recording_file);
+
+    struct sockaddr_storage server_address = get_server_address(host, port, family);
+
+    // Every recorded connection needs its own descriptor.
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    hdr_init(&reply_latency, HIGHEST_LATENCY, 3);
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        syserr("epoll_create1");
+    }
+
+    // Events are played in the recorded order. Each one waits for its time,
+    // unless playing as fast as possible, and for the messages it answered.
+    int64_t start_time = now_ns();
+    int64_t waiting_since = start_time;
+    size_t next_event = 0;
+    struct epoll_event ready[MAX_EVENTS];
+    while (next_event < no_events || open_conns > 0) {
+        int64_t now = now_ns();
+        while (next_event < no_events) {
+            replay_event_t const *event = &events[next_event];
+            if (!fast && start_time + event->time > now) {
+                break;
+            }
+            if (!is_ready(event)) {
+                if (now - waiting_since < STALL_TIMEOUT) {
+                    break;
+                }
+                // The server answers differently than when recorded.
+                stalls++;
+            }
+            play_event(event, &server_address);
+            next_event++;
+            waiting_since = now;
+        }
+
+        int wait_ms = -1;
+        if (next_event < no_events) {
+            int64_t wait_ns = now - waiting_since < STALL_TIMEOUT ?
+                waiting_since + STALL_TIMEOUT - now : 0;
+            if (!fast && start_time + events[next_event].time - now < wait_ns) {
+                wait_ns = start_time + events[next_event].time - now;
+            }
+            wait_ms = wait_ns > 0 ? (int) ((wait_ns + NS_IN_MSEC - 1) / NS_IN_MSEC) : 0;
+        }
+        int ret = epoll_wait(epoll_fd, ready, MAX_EVENTS, wait_ms);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("epoll_wait");
+        }
+
+        int64_t received_time = now_ns();
+        for (int e = 0; e < ret; e++) {
+            handle_input(ready[e].data.ptr, received_time);
+        }
+    }
+
+    // Print the summary.
+    double elapsed = (double) (now_ns() - start_time) / NS_IN_SEC;
+    printf("total %.2fs connections %zu events %zu stalls %" PRIu64 " msgs %" PRIu64
+        " (%.0f/s)\n", elapsed, no_conns, no_events, stalls, msgs_in + msgs_out,
+        (double) (msgs_in + msgs_out) / elapsed);
+    hdr_print(stdout, "msg->reply", &reply_latency);
+
+    close(epoll_fd);
+    hdr_free(&reply_latency);
+    for (size_t i = 0; i < no_events; i++) {
+        free(events[i].msg);
+    }
+    free(events);
+    free(conns);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For accept4().
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
@@ -13,25 +14,128 @@
 #include <sys/time.h>
 #include <stdbool.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/un.h>
 
 #include "err.h"
 #include "common.h"
-
-#define QUEUE_LENGTH 5
-#define NO_PLAYERS 4
-#define POLL_SIZE 9
+#include "rules.h"
+#include "deal.h"
+#include "messages.h"
+#include "compact.h"
+#include "ring.h"
+#include "msgbuf.h"
+#include "journal.h"
+#include "metrics.h"
+#include "hdr.h"
+#include "probes.h"
+
+#define QUEUE_LENGTH SOMAXCONN // Default length of the accept queues.
 #define NO_TRICKS 13
+#define SPECTATOR_QUEUE_LIMIT 4096
+#define TABLE_DESC_SIZE 4096
+#define HIGHEST_LATENCY INT64_C(10000000000) // In nanoseconds, longer ones count as it.
+#define LATENCY_FIGURES 2 // Significant figures of the latencies.
 
+#define ANY 0 // Wanted place of clients who accept any place.
 #define N 1
 #define E 2
 #define S 3
 #define W 4
 
-// Struct to store socket and last activity time.
-typedef struct socket_info_t {
-    int fd;
+// Kinds of connections handled by the server.
+typedef enum client_kind_t {
+    CLIENT_NONE,      // Descriptor not used.
+    CLIENT_LISTENER,
+    CLIENT_PENDING,   // Connected, didn't introduce himself yet.
+    CLIENT_WAITING,   // Waiting in the lobby for a place at a table.
+    CLIENT_PLAYER,
+    CLIENT_SPECTATOR,
+    CLIENT_HANDOFF,   // Socket waiting for the server taking over.
+    CLIENT_METRICS,   // Socket waiting for metrics scrapers.
+    CLIENT_SCRAPER,   // Connected, didn't ask for the metrics yet.
+} client_kind_t;
+
+typedef struct table_t table_t;
+
+// Struct to store a connection, clients are indexed by their descriptors.
+typedef struct client_t {
+    client_kind_t kind;
+    size_t poll_id;       // Index in poll_fds.
     time_t last_activity;
-} socket_info_t;
+    table_t *table;       // Table of a player or a spectator.
+    int place_id;         // Place at the table, or the wanted one when waiting.
+    int prev_waiting;     // Neighbours in the wait queue, -1 if none.
+    int next_waiting;
+    size_t watch_id;      // Index in the spectators of the table, or in parked_fds.
+    bool parked;          // Spectator waiting for his table to open.
+    int watched_id;       // Number of the table a parked spectator waits for.
+    msg_queue_t out;      // Messages waiting for a spectator.
+    uint64_t conn_id;     // Number of the connection in the recording.
+    uint64_t msgs_sent;   // Messages sent to the connection so far.
+    frame_buf_t in;       // Received data not handled yet.
+    ring_t ring;          // Shared memory the messages go through (see ring.h).
+
+    // Flood control, see take_token() and send_wrong().
+    double tokens;        // Messages the client may send right now.
+    int64_t tokens_time;  // When the tokens were counted (ns).
+    size_t strikes;       // Unwanted messages since the last accepted card.
+    int64_t wrong_time;   // When the last WRONG was sent (ns).
+    int wrong_trick;      // Trick number of the last WRONG, 0 if none.
+} client_t;
+
+// Struct to store a table and the game played at it.
+struct table_t {
+    int id;
+    int place_fds[NO_PLAYERS + 1]; // Indexed by place, -1 if free.
+    int ready_players;
+
+    // Variables to store information about the game.
+    int current_game;
+    int current_trick;
+    int current_player;
+    bool deal_in_progress;
+    card_t hands[NO_PLAYERS][NO_TRICKS]; // Cards not played yet in the current deal.
+    card_t cards_played[NO_TRICKS][NO_PLAYERS];
+    int who_played[NO_PLAYERS]; // Values are from 1 to NO_PLAYERS.
+    int total_points[NO_PLAYERS];
+    int points[NO_PLAYERS];
+
+    // Messages of the current deal, kept for clients joining in the middle.
+    msgbuf_t *deal_bufs[NO_PLAYERS];
+    msgbuf_t *taken_bufs[NO_TRICKS];
+    int no_taken;
+
+    // Monotonic times of the first TRICK of the turn and of the trick, 0 if
+    // not measured.
+    int64_t turn_start;
+    int64_t trick_start;
+
+    // Latencies of the players' decisions by place and wall times of tricks,
+    // so a slow bot can be told by its table.
+    hdr_hist_t decision_latency[NO_PLAYERS];
+    hdr_hist_t trick_time;
+
+    // Deal made for the table when the deals are generated, see table_deal().
+    game_desc_t generated;
+    int generated_game;   // Number of the generated deal, -1 if none.
+    msgbuf_t *generated_msgs[NO_PLAYERS];
+
+    int *spectator_fds;
+    size_t no_spectators;
+    size_t spectators_capacity;
+
+    table_t *next;
+};
+
+// Struct to store a queue of clients waiting for a place.
+typedef struct wait_queue_t {
+    int head;
+    int tail;
+    size_t count;
+} wait_queue_t;
 
 // Function to get current time
 static time_t current_time() {
@@ -43,147 +147,212 @@ static double calculate_inactivity_duration(time_t last_activity_time) {
     return difftime(current_time(), last_activity_time);
 }
 
-// Struct to store information about game.
-typedef struct game_desc_t {
-    char game_type;
-    char starting_player;
-    card_t cards[NO_PLAYERS][NO_TRICKS];
-} game_desc_t;
-
 // Variables to store command line arguments.
 uint16_t port = 0;
 char *game_file = NULL;
+size_t no_generated = 0; // Deals generated for every table instead of the file.
+uint64_t deal_seed = 1;
 time_t timeout = 5;
+time_t iam_timeout = 5; // Time for a new client to introduce himself.
+bool iam_timeout_set = false;
+int queue_length = QUEUE_LENGTH;
+size_t msg_rate = 0;       // Messages per second of a connection, 0 if any.
+int64_t wrong_window = 0;  // Repeated WRONG is not sent within it (ns).
+size_t max_strikes = 0;    // Unwanted messages before dropping, 0 if no limit.
+bool lobby_mode = false;
+char *journal_path = NULL;
+char *handoff_path = NULL;  // Where to wait for the next server.
+char *takeover_path = NULL; // Where to take the clients over from.
+char *metrics_address = NULL; // Port or Unix socket path of the metrics.
+bool metrics_listening = false;
+char *recording_path = NULL;
+char *unix_path = NULL; // Where to listen for clients on this host.
+int busy_poll_us = 0;   // Spin before sleeping in poll(), 0 if not.
+int pinned_cpu = -1;    // CPU running the event loop, -1 if any.
+
+// Recording of the messages received, see save_input().
+FILE *recording = NULL;
+int64_t recording_start;
+uint64_t next_conn_id = 0;
 
 // Variables to store information about games.
 int no_of_games;
 game_desc_t *game_desc;
-int current_game = 0;
-int current_trick = 0;
-int ready_players = 0;
-int current_player = 0;
-card_t cards_played[NO_TRICKS][NO_PLAYERS];
-int who_played[NO_PLAYERS]; // Values are from 1 to NO_PLAYERS.
-int total_points[NO_PLAYERS];
-int points[NO_PLAYERS];
-int who_took_trick = 0;
+msgbuf_t **deal_msgs; // DEAL messages by deal and place, shared by all tables.
+table_t *tables = NULL; // Oldest first.
+table_t *last_table = NULL;
+int next_table_id = 0;
+
+// Set by SIGUSR1 to print the latencies of the open tables.
+volatile sig_atomic_t dump_requested = 0;
+
+// Journal of the games, opened after the recovery.
+journal_t journal;
+bool journal_opened = false;
+
+// Clients waiting in the lobby, by the wanted place.
+wait_queue_t wait_queues[NO_PLAYERS + 1];
 
 // Poll structure.
-struct pollfd poll_fds[POLL_SIZE];
-socket_info_t poll_fds_info[POLL_SIZE];
+struct pollfd *poll_fds = NULL;
+size_t no_poll_fds = 0;
+size_t poll_fds_capacity = 0;
+
+// Clients by descriptor.
+client_t *clients = NULL;
+size_t clients_capacity = 0;
+
+// Spectators of the tables not opened yet.
+int *parked_fds = NULL;
+size_t no_parked = 0;
+size_t parked_capacity = 0;
+
+// Set when clients who weren't heard may have complete messages waiting in
+// their buffers.
+bool input_buffered = false;
+
+// Descriptor kept free to turn connections away when there are no others,
+// -1 if it couldn't be opened again.
+int spare_fd = -1;
+
+// Set when the listeners aren't polled until a descriptor is freed.
+bool accepting_paused = false;
 
 // Function to parse command line arguments.
 static void parse_args(int argc, char *argv[]) {
     bool file_set = false;
-    for (int i = 1; i < argc; i += 2) {
-        if (strcmp(argv[i], "-p") == 0) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0) {
+            lobby_mode = true;
+        } else if (strcmp(argv[i], "-p") == 0) {
             if (i + 1 == argc) {
                 fatal("No port specified.\n");
             }
-            port = read_port(argv[i+1]);
+            port = read_port(argv[++i]);
         } else if (strcmp(argv[i], "-t") == 0) {
             if (i + 1 == argc) {
                 fatal("No timeout specified.\n");
             }
-            timeout = read_time(argv[i+1]);
+            timeout = read_time(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            if (i + 1 == argc) {
+                fatal("No introduction timeout specified.\n");
+            }
+            iam_timeout = read_time(argv[++i]);
+            iam_timeout_set = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (i + 1 == argc) {
+                fatal("No message rate specified.\n");
+            }
+            msg_rate = read_size(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            if (i + 1 == argc) {
+                fatal("No WRONG window specified.\n");
+            }
+            wrong_window = (int64_t) read_size(argv[++i]) * 1000000;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if (i + 1 == argc) {
+                fatal("No strike limit specified.\n");
+            }
+            max_strikes = read_size(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            if (i + 1 == argc) {
+                fatal("No queue length specified.\n");
+            }
+            queue_length = (int) read_size(argv[++i]);
+        } else if (strcmp(argv[i], "-j") == 0) {
+            if (i + 1 == argc) {
+                fatal("No journal file specified.\n");
+            }
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "-x") == 0) {
+            if (i + 1 == argc) {
+                fatal("No handoff socket specified.\n");
+            }
+            handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "-X") == 0) {
+            if (i + 1 == argc) {
+                fatal("No takeover socket specified.\n");
+            }
+            takeover_path = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0) {
+            if (i + 1 == argc) {
+                fatal("No metrics address specified.\n");
+            }
+            metrics_address = argv[++i];
+        } else if (strcmp(argv[i], "-u") == 0) {
+            if (i + 1 == argc) {
+                fatal("No Unix socket path specified.\n");
+            }
+            unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-B") == 0) {
+            if (i + 1 == argc) {
+                fatal("No busy poll time specified.\n");
+            }
+            busy_poll_us = (int) read_size(argv[++i]);
+        } else if (strcmp(argv[i], "-C") == 0) {
+            if (i + 1 == argc) {
+                fatal("No CPU specified.\n");
+            }
+            pinned_cpu = (int) read_size(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0) {
+            if (i + 1 == argc) {
+                fatal("No recording file specified.\n");
+            }
+            recording_path = argv[++i];
         } else if (strcmp(argv[i], "-f") == 0) {
             if (i + 1 == argc) {
                 fatal("No game file specified.\n");
             }
             file_set = true;
-            game_file = argv[i+1];
+            game_file = argv[++i];
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if (i + 1 == argc) {
+                fatal("No number of deals specified.\n");
+            }
+            no_generated = read_size(argv[++i]);
+            if (no_generated == 0 || no_generated > INT_MAX) {
+                fatal("Invalid number of deals: %s\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            if (i + 1 == argc) {
+                fatal("No seed specified.\n");
+            }
+            deal_seed = read_size(argv[++i]);
         } else {
             fatal("Invalid argument: %s\n", argv[i]);
         }
     }
-    if (!file_set) {
-        fatal("No game file specified.\n");
-    }
-}
-
-// Function to count lines of game description file.
-static int count_lines() {
-    FILE *file = fopen(game_file, "r");
-    if (file == NULL) {
-        syserr("Failed to open game description file.");
-    }
-
-    int line_count = 0;
-    char ch;
-
-    // Count the number of newline characters
-    while ((ch = fgetc(file)) != EOF) {
-        if (ch == '\n') {
-            line_count++;
-        }
-    }
-
-    fclose(file);
-
-    return line_count;
-}
-
-// Converts card number to proper array index (automatic play).
-static int numtoi(char num) {
-    if (num == '1') {
-        return 8;
-    } else if (num == 'J') {
-        return 9;
-    } else if (num == 'Q') {
-        return 10;
-    } else if (num == 'K') {
-        return 11;
-    } else if (num == 'A') {
-        return 12;
-    } else {
-        return num - '0' - 2;
+    if (file_set == (no_generated != 0)) {
+        fatal("Either a game file or a number of deals must be specified.\n");
     }
-}
-
-// Function to parse game description file.
-static void parse_game_file() {
-    no_of_games = count_lines() / 5;
-    
-    game_desc = malloc(no_of_games * sizeof(game_desc_t));
-
-    FILE *file = fopen(game_file, "r");
-    if (file == NULL) {
-        syserr("Failed to open game description file.");
-    }
-
-    for(int i = 0; i < no_of_games; i++) {
-        game_desc[i].game_type = fgetc(file);
-        game_desc[i].starting_player = fgetc(file);
-        fgetc(file); // Skip the newline character.
-        for (int j = 0; j < 4; j++) {
-            for(int k = 0; k < 13; k++) {
-                game_desc[i].cards[j][k].num = fgetc(file);
-                if (game_desc[i].cards[j][k].num == '1') {
-                    fgetc(file); // Skip the '0' character.
-                }
-                game_desc[i].cards[j][k].col = fgetc(file);
-            }
-            fgetc(file); // Skip the newline character.
-        }
+    if (!iam_timeout_set) {
+        iam_timeout = timeout;
     }
-
-    fclose(file);
 }
 
-// Function to initialize the server socket.
-static int prepare_connection() {
-    // Create an IPv6 socket.
-    int socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
+// Function to initialize a listening socket on the port.
+static int prepare_connection(uint16_t port) {
+    // Create an IPv6 socket. It doesn't block, as the clients are accepted
+    // until the queue is empty.
+    int socket_fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (socket_fd < 0) {
         syserr("cannot create a socket");
     }
-    
+
     // Allow the socket to accept both IPv4 and IPv6 connections
     int option = 0;
     if (setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &option, sizeof(option)) < 0) {
         syserr("setsockopt");
     }
 
+    // Allow restarting the server right away, connections of the previous
+    // run may still wait in TIME_WAIT.
+    option = 1;
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option)) < 0) {
+        syserr("setsockopt");
+    }
+
     // Bind the socket to a concrete address.
     struct sockaddr_in6 server_address;
     memset(&server_address, 0, sizeof(server_address));
@@ -196,7 +365,7 @@ static int prepare_connection() {
     }
 
     // Switch the socket to listening.
-    if (listen(socket_fd, QUEUE_LENGTH) < 0) {
+    if (listen(socket_fd, queue_length) < 0) {
         syserr("listen");
     }
 
@@ -212,25 +381,19 @@ static int prepare_connection() {
 
 // Function to print raport about exchanged messages.
 static void raport(int socket_fd, char *msg, bool from_client) {
-    // Get local IP address and port
-    struct sockaddr_in6 local_address;
-    socklen_t local_address_len = sizeof(local_address);
-    if (getsockname(socket_fd, (struct sockaddr *) &local_address, &local_address_len) == -1) {
+    // Get local and client addresses.
+    char local_endpoint[ENDPOINT_SIZE];
+    if (!format_endpoint(socket_fd, false, local_endpoint, sizeof(local_endpoint))) {
         syserr("getsockname");
     }
-    char local_ip[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &(local_address.sin6_addr), local_ip, sizeof(local_ip));
-    int local_port = ntohs(local_address.sin6_port);
-
-    // Get server IP address and port
-    struct sockaddr_in6 server_address;
-    socklen_t server_address_len = sizeof(server_address);
-    if (getpeername(socket_fd, (struct sockaddr *) &server_address, &server_address_len) == -1) {
+    char client_endpoint[ENDPOINT_SIZE];
+    if (!format_endpoint(socket_fd, true, client_endpoint, sizeof(client_endpoint))) {
+        if (errno == ENOTCONN) {
+            // The client has already gone, the server will notice it soon.
+            return;
+        }
         syserr("getpeername");
     }
-    char server_ip[INET6_ADDRSTRLEN];
-    inet_ntop(AF_INET6, &(server_address.sin6_addr), server_ip, sizeof(server_ip));
-    int server_port = ntohs(server_address.sin6_port);
 
     // Get the current time
     struct timeval tv;
@@ -251,673 +414,2108 @@ static void raport(int socket_fd, char *msg, bool from_client) {
     // Print the whole raport.
     msg[strlen(msg) - 2] = '\0';
     if (from_client) {
-        printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", server_ip, server_port, 
-            local_ip, local_port, time_str, tv.tv_usec / 1000, msg);
+        printf("[%s,%s,%s.%03ld] %s\\r\\n\n", client_endpoint, local_endpoint,
+            time_str, tv.tv_usec / 1000, msg);
     } else {
-        printf("[%s:%d,%s:%d,%s.%03ld] %s\\r\\n\n", local_ip, local_port, 
-            server_ip, server_port, time_str, tv.tv_usec / 1000, msg);
+        printf("[%s,%s,%s.%03ld] %s\\r\\n\n", local_endpoint, client_endpoint,
+            time_str, tv.tv_usec / 1000, msg);
     }
     msg[strlen(msg)] = '\r';
 }
 
-// Function to determine who took the trick.
-static int resolve(int trick_num) {
-    char col = cards_played[trick_num][0].col;
-    char num = cards_played[trick_num][0].num;
-    int who_took = who_played[0];
-    for (int i = 1; i < NO_PLAYERS; i++) {
-        if (cards_played[trick_num][i].col == col && 
-            numtoi(cards_played[trick_num][i].num) > numtoi(num)) {
-            num = cards_played[trick_num][i].num;
-            who_took = who_played[i];
-        }
-    }
-    if (game_desc[current_game].game_type == '1' || 
-        game_desc[current_game].game_type == '7') {
-        points[who_took - 1] += 1;
-    } if (game_desc[current_game].game_type == '2' || 
-        game_desc[current_game].game_type == '7') {
-        for (int i = 0; i < NO_PLAYERS; i++) {
-            if (cards_played[trick_num][i].col == 'H') {
-                points[who_took - 1] += 1;
-            }
-        }
-    } if (game_desc[current_game].game_type == '3' || 
-        game_desc[current_game].game_type == '7') {
-        for (int i = 0; i < NO_PLAYERS; i++) {
-            if (cards_played[trick_num][i].num == 'Q') {
-                points[who_took - 1] += 5;
-            }
-        }
-    } if (game_desc[current_game].game_type == '4' || 
-        game_desc[current_game].game_type == '7') {
-        for (int i = 0; i < NO_PLAYERS; i++) {
-            if (cards_played[trick_num][i].num == 'J' || 
-                cards_played[trick_num][i].num == 'K') {
-                points[who_took - 1] += 2;
-            }
-        }
-    } if (game_desc[current_game].game_type == '5' || 
-        game_desc[current_game].game_type == '7') {
-        for (int i = 0; i < NO_PLAYERS; i++) {
-            if (cards_played[trick_num][i].col == 'H' && 
-                cards_played[trick_num][i].num == 'K') {
-                points[who_took - 1] += 18;
-            }
-        }
-    } if (game_desc[current_game].game_type == '6' || 
-        game_desc[current_game].game_type == '7') {
-        if (trick_num == 6 || trick_num == 12) {
-            points[who_took - 1] += 10;
-        }
-    }
-    return who_took;
+// Function to print raport about a shared message.
+static void raport_buf(int socket_fd, msgbuf_t const *buf) {
+    char msg[BUF_SIZE];
+    memcpy(msg, buf->data, buf->len + 1);
+    raport(socket_fd, msg, false);
 }
 
-// Function to send information about ongoing game.
-static void send_game_info(int client_fd, int place_id) {
-    // Send game data.
-    char *msg = malloc(BUF_SIZE * sizeof(char));
-    memset(msg, 0, BUF_SIZE * sizeof(char));
-    strcat(msg, "DEAL");
-    msg[strlen(msg)] = game_desc[current_game].game_type;
-    msg[strlen(msg)] = game_desc[current_game].starting_player;
-    for (int i = 0; i < NO_TRICKS; i++) {
-        msg[strlen(msg)] = game_desc[current_game].cards[place_id - 1][i].num;
-        if (game_desc[current_game].cards[place_id - 1][i].num == '1') {
-            msg[strlen(msg)] = '0';
+// Function to write the message in the form the client talks in. Returns
+// false if the connection is broken.
+static bool write_msg(int client_fd, char const *msg, size_t msg_len) {
+    uint8_t frame[COMPACT_MAX_LEN];
+    if (clients[client_fd].in.compact) {
+        msg_len = compact_encode(frame, msg);
+        if (msg_len == 0) {
+            return false;
         }
-        msg[strlen(msg)] = game_desc[current_game].cards[place_id - 1][i].col;
+        msg = (char const *) frame;
     }
-    strcat(msg, "\r\n");
+    if (clients[client_fd].ring.shared != NULL) {
+        return ring_write(&clients[client_fd].ring, msg, msg_len);
+    }
+    ssize_t written_length = writen(client_fd, msg, msg_len);
+    return written_length >= 0 && (size_t) written_length == msg_len;
+}
 
+// Function to send a message to a player. A broken connection is only shut
+// down here, the main loop notices it and frees the place.
+static void send_msg(int client_fd, char *msg) {
     raport(client_fd, msg, false);
+    COUNT_OUT(msg_type(msg), 1);
+    PROBE2(msg_send, client_fd, msg);
+    clients[client_fd].msgs_sent++;
 
-    ssize_t written_length = writen(client_fd, msg, strlen(msg));
-    if (written_length < 0) {
-        syserr("writen");
+    if (!write_msg(client_fd, msg, strlen(msg))) {
+        shutdown(client_fd, SHUT_RDWR);
     }
-    else if ((size_t) written_length != strlen(msg)) {
-        fatal("incomplete writen");
+}
+
+// Function to send a shared message to a player, like send_msg().
+static void send_buf(int client_fd, msgbuf_t const *buf) {
+    raport_buf(client_fd, buf);
+    COUNT_OUT(msg_type(buf->data), 1);
+    PROBE2(msg_send, client_fd, buf->data);
+    clients[client_fd].msgs_sent++;
+
+    if (!write_msg(client_fd, buf->data, buf->len)) {
+        shutdown(client_fd, SHUT_RDWR);
     }
+}
 
-    for (int i = 0; i < NO_TRICKS; i++) {
-        if (cards_played[i][NO_PLAYERS - 1].num == 0) {
-            break;
+// Function to write the received message, or the end of the connection if
+// msg is NULL, to the recording. Every entry is a line
+// "<ns since start> <connection> <event> <messages sent to it> <length>"
+// followed by the message itself and a newline. Events are 'c' (connected),
+// 'm' (message) and 'd' (disconnected).
+static void save_input(int client_fd, char event, char const *msg) {
+    if (recording == NULL) {
+        return;
+    }
+    size_t len = msg == NULL ? 0 : strlen(msg);
+    fprintf(recording, "%" PRId64 " %" PRIu64 " %c %" PRIu64 " %zu\n",
+        monotonic_ns() - recording_start, clients[client_fd].conn_id, event,
+        clients[client_fd].msgs_sent, len);
+    fwrite(msg == NULL ? "" : msg, 1, len, recording);
+    fputc('\n', recording);
+}
+
+// Function to start tracking a new connection.
+static void add_client(int client_fd, client_kind_t kind) {
+    if ((size_t) client_fd >= clients_capacity) {
+        size_t capacity = clients_capacity == 0 ? 64 : clients_capacity;
+        while (capacity <= (size_t) client_fd) {
+            capacity *= 2;
         }
-        memset(msg, 0, BUF_SIZE * sizeof(char));
+        clients = realloc(clients, capacity * sizeof(client_t));
+        if (clients == NULL) {
+            syserr("realloc");
+        }
+        memset(clients + clients_capacity, 0, (capacity - clients_capacity) * sizeof(client_t));
+        clients_capacity = capacity;
+    }
+    if (no_poll_fds == poll_fds_capacity) {
+        poll_fds_capacity = poll_fds_capacity == 0 ? 64 : 2 * poll_fds_capacity;
+        poll_fds = realloc(poll_fds, poll_fds_capacity * sizeof(struct pollfd));
+        if (poll_fds == NULL) {
+            syserr("realloc");
+        }
+    }
 
-        int who_took = resolve(i);
-        strcat(msg, "TAKEN");
-        char num[15];
-        sprintf(num, "%d", i + 1);
-        strcat(msg, num);
-        if (who_took == N) {
-            msg[strlen(msg)] = 'N';
-        } else if (who_took == E) {
-            msg[strlen(msg)] = 'E';
-        } else if (who_took == S) {
-            msg[strlen(msg)] = 'S';
-        } else {
-            msg[strlen(msg)] = 'W';
+    client_t *client = &clients[client_fd];
+    memset(client, 0, sizeof(client_t));
+    client->kind = kind;
+    client->poll_id = no_poll_fds;
+    client->last_activity = current_time();
+    client->prev_waiting = -1;
+    client->next_waiting = -1;
+    client->conn_id = next_conn_id++;
+    msg_queue_init(&client->out);
+    frame_init(&client->in);
+
+    poll_fds[no_poll_fds].fd = client_fd;
+    poll_fds[no_poll_fds].events = POLLIN;
+    poll_fds[no_poll_fds].revents = 0;
+    no_poll_fds++;
+}
+
+// Function to set the events polled on all the listening sockets.
+static void set_listener_events(short events) {
+    for (size_t i = 0; i < no_poll_fds; i++) {
+        client_kind_t kind = clients[poll_fds[i].fd].kind;
+        if (kind == CLIENT_LISTENER || kind == CLIENT_METRICS) {
+            poll_fds[i].events = events;
         }
-        strcat(msg, "\r\n");
+    }
+}
 
+// Function to close the connection and forget the client.
+static void remove_client(int client_fd) {
+    client_t *client = &clients[client_fd];
+    msg_queue_free(&client->out);
+    ring_free(&client->ring);
+    client->kind = CLIENT_NONE;
+
+    // Move the last poll entry into the free place.
+    no_poll_fds--;
+    poll_fds[client->poll_id] = poll_fds[no_poll_fds];
+    clients[poll_fds[client->poll_id].fd].poll_id = client->poll_id;
+
+    close(client_fd);
+    if (accepting_paused) {
+        // There is a descriptor for the next connection now.
+        accepting_paused = false;
+        set_listener_events(POLLIN);
     }
+}
 
-    free(msg);
+// Function to set the events polled on the client's connection.
+static void set_events(int client_fd, short events) {
+    poll_fds[clients[client_fd].poll_id].events = events;
 }
 
-// Function to check if a place for player is free.
-static int check_for_place(int client_fd, char place) {
-    int place_id;
+// Function to get the place of the given letter, -1 if invalid.
+static int place_of_char(char place) {
     if (place == 'N') {
-        place_id = N;
+        return N;
     } else if (place == 'E') {
-        place_id = E;
+        return E;
     } else if (place == 'S') {
-        place_id = S;
+        return S;
     } else if (place == 'W') {
-        place_id = W;
-    } else {
-        return -1;
+        return W;
+    } else if (place == '*') {
+        return ANY;
     }
-    if (poll_fds[place_id].fd != -1) {
-        // Send BUSY message.
-        char *msg = malloc(BUF_SIZE * sizeof(char));
-        memset(msg, 0, BUF_SIZE * sizeof(char));
-        strcat(msg, "BUSY");
-        if (poll_fds[N].fd == -1) {
-            strcat(msg, "N");
-        } else if (poll_fds[E].fd == -1) {
-            strcat(msg, "E");
-        } else if (poll_fds[S].fd == -1) {
-            strcat(msg, "S");
-        } else if (poll_fds[W].fd == -1) {
-            strcat(msg, "W");
-        }
-        strcat(msg, "\r\n");
+    return -1;
+}
 
-        raport(client_fd, msg, false);
+// Function to get the letter of the place.
+static char char_of_place(int place_id) {
+    return "*NESW"[place_id];
+}
 
-        ssize_t written_length = writen(client_fd, msg, strlen(msg));
-        if (written_length < 0) {
-            syserr("writen");
-        }
-        else if ((size_t) written_length != strlen(msg)) {
-            fatal("incomplete writen");
-        }
-        free(msg);
-        return -1;
-    }  else {
-        // Update poll structure.
-        poll_fds[place_id].fd = client_fd;
-        poll_fds[place_id].events = POLLIN;
-        poll_fds_info[place_id].fd = client_fd;
-        poll_fds_info[place_id].last_activity = current_time();
-
-        send_game_info(client_fd, place_id);
-        ready_players++;
-        return 0;
+// Function to disconnect the spectator.
+static void remove_spectator(int client_fd) {
+    table_t *table = clients[client_fd].table;
+    if (clients[client_fd].parked) {
+        size_t id = clients[client_fd].watch_id;
+        no_parked--;
+        parked_fds[id] = parked_fds[no_parked];
+        clients[parked_fds[id]].watch_id = id;
+        clients[client_fd].parked = false;
+    } else if (table != NULL) {
+        // Move the last spectator of the table into the free place.
+        size_t id = clients[client_fd].watch_id;
+        table->no_spectators--;
+        table->spectator_fds[id] = table->spectator_fds[table->no_spectators];
+        clients[table->spectator_fds[id]].watch_id = id;
     }
+    remove_client(client_fd);
 }
 
-// Function to wait for clients to connect.
-static void get_players() {
-    while (ready_players < NO_PLAYERS) {
-        // Clear poll revents.
-        for (int i = 0; i < POLL_SIZE; i++) {
-            poll_fds[i].revents = 0;
+// Function to queue the message to the spectator and send what is possible.
+// Returns false if the spectator was disconnected.
+static bool send_to_spectator(int client_fd, msgbuf_t *buf) {
+    client_t *spectator = &clients[client_fd];
+    if (spectator->out.count >= SPECTATOR_QUEUE_LIMIT) {
+        // The spectator doesn't keep up with the game.
+        remove_spectator(client_fd);
+        return false;
+    }
+    msg_queue_push(&spectator->out, buf);
+    COUNT_OUT(msg_type(buf->data), 1);
+    PROBE2(msg_send, client_fd, buf->data);
+    spectator->msgs_sent++;
+    if (msg_queue_flush(&spectator->out, client_fd) < 0) {
+        remove_spectator(client_fd);
+        return false;
+    }
+    set_events(client_fd, spectator->out.count > 0 ? POLLIN | POLLOUT : POLLIN);
+    return true;
+}
+
+// Function to send the message to all spectators of the table. The message
+// is not copied, every queue only keeps a reference to it.
+static void send_to_spectators(table_t *table, msgbuf_t *buf) {
+    size_t id = 0;
+    while (id < table->no_spectators) {
+        if (send_to_spectator(table->spectator_fds[id], buf)) {
+            id++;
         }
+    }
+}
 
-        // Wait for a client to connect.
-        int ret = poll(poll_fds, POLL_SIZE, timeout * 1000);
-        if (ret < 0) {
-            syserr("poll");
-        } else {
-            // Check if the server socket received a connection.
-            if (poll_fds[0].revents & POLLIN) {
-                // New connection: new client is accepted.
-                struct sockaddr_storage client_address;
-                int client_fd = accept(poll_fds[0].fd,
-                                       (struct sockaddr *) &client_address,
-                                       &((socklen_t){sizeof client_address}));
-                if (client_fd < 0) {
-                    syserr("accept");
-                }
+// Function to make a client a spectator of the table and, if asked to,
+// send him the current deal.
+static void add_spectator(table_t *table, int client_fd, bool catch_up) {
+    int flags = fcntl(client_fd, F_GETFL);
+    if (flags < 0 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        syserr("fcntl");
+    }
 
-                for (int i = NO_PLAYERS + 1; i < POLL_SIZE; i++) {
-                    if (poll_fds[i].fd == -1) {
-                        poll_fds[i].fd = client_fd;
-                        poll_fds[i].events = POLLIN;
-                        poll_fds_info[i].fd = client_fd;
-                        poll_fds_info[i].last_activity = current_time();
-                        break;
-                    }
-                }
-            }
+    if (table->no_spectators == table->spectators_capacity) {
+        table->spectators_capacity = table->spectators_capacity == 0 ? 8 :
+            2 * table->spectators_capacity;
+        table->spectator_fds = realloc(table->spectator_fds,
+            table->spectators_capacity * sizeof(int));
+        if (table->spectator_fds == NULL) {
+            syserr("realloc");
+        }
+    }
+    clients[client_fd].kind = CLIENT_SPECTATOR;
+    clients[client_fd].table = table;
+    clients[client_fd].watch_id = table->no_spectators;
+    table->spectator_fds[table->no_spectators++] = client_fd;
 
-            // Chceck the awaiting clients for input.
-            for (int i = NO_PLAYERS + 1; i < POLL_SIZE; i++) {
-                if (poll_fds[i].fd != -1) {
-                    if (poll_fds[i].revents & POLLIN) {
-                        // Receive input from the client.
-                        char *msg = read_msg(poll_fds[i].fd);
-                        if (msg == NULL) {
-                            // Client disconnected.
-                            printf("Client disconnected\n");
-                            close(poll_fds[i].fd);
-                            poll_fds[i].fd = -1;
-                            poll_fds_info[i].fd = -1;
-                            continue;
-                        }
-
-                        raport(poll_fds[i].fd, msg, true);
-
-                        if (strncmp(msg, "IAM", 3) == 0 && 
-                            strlen(msg) == strlen("IAM") + strlen("\r\n") + 1) {
-                            char place = msg[3];
-                            int code = check_for_place(poll_fds[i].fd, place);
-                            if (code == -1) {
-                                close(poll_fds[i].fd);
-                            }
-                            poll_fds[i].fd = -1;
-                            poll_fds_info[i].fd = -1;
-                        } else {
-                            close(poll_fds[i].fd);
-                            poll_fds[i].fd = -1;
-                            poll_fds_info[i].fd = -1;
-                        }
-                    } else {
-                        // Check for timeout.
-                        if (calculate_inactivity_duration
-                            (poll_fds_info[i].last_activity) > timeout) {
-                            close(poll_fds[i].fd);
-                            poll_fds[i].fd = -1;
-                            poll_fds_info[i].fd = -1;
-                        }
-                    }
-                }
+    if (catch_up && table->deal_in_progress) {
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            if (!send_to_spectator(client_fd, table->deal_bufs[i])) {
+                return;
+            }
+        }
+        for (int i = 0; i < table->no_taken; i++) {
+            if (!send_to_spectator(client_fd, table->taken_bufs[i])) {
+                return;
             }
         }
     }
 }
 
-// Function to send "TRICK" message.
-static void send_trick() {
-    // Send the trick.
-    char *msg = malloc(BUF_SIZE * sizeof(char));
-    memset(msg, 0, BUF_SIZE * sizeof(char));
-    strcat(msg, "TRICK");
-    char num[15];
-    sprintf(num, "%d", current_trick + 1);
-    strcat(msg, num);
-    for (int i = 0; i < NO_PLAYERS; i++) {
-        if (cards_played[current_trick][i].num!= 0) {
-            msg[strlen(msg)] = cards_played[current_trick][i].num;
-            if (cards_played[current_trick][i].num == '1') {
-                msg[strlen(msg)] = '0';
-            }
-            msg[strlen(msg)] = cards_played[current_trick][i].col;
+// Function to make a client a spectator of the table which is not opened
+// yet. He starts getting its messages when it opens.
+static void park_spectator(int client_fd, int table_id) {
+    if (no_parked == parked_capacity) {
+        parked_capacity = parked_capacity == 0 ? 8 : 2 * parked_capacity;
+        parked_fds = realloc(parked_fds, parked_capacity * sizeof(int));
+        if (parked_fds == NULL) {
+            syserr("realloc");
         }
     }
-    strcat(msg, "\r\n");
+    clients[client_fd].kind = CLIENT_SPECTATOR;
+    clients[client_fd].table = NULL;
+    clients[client_fd].parked = true;
+    clients[client_fd].watched_id = table_id;
+    clients[client_fd].watch_id = no_parked;
+    parked_fds[no_parked++] = client_fd;
+}
 
-    raport(poll_fds[current_player].fd, msg, false);
+// Function to move the spectators waiting for the table to it.
+static void unpark_spectators(table_t *table) {
+    for (size_t i = no_parked; i-- > 0;) {
+        int client_fd = parked_fds[i];
+        if (clients[client_fd].watched_id == table->id) {
+            no_parked--;
+            parked_fds[i] = parked_fds[no_parked];
+            clients[parked_fds[i]].watch_id = i;
+            clients[client_fd].parked = false;
+            add_spectator(table, client_fd, false);
+        }
+    }
+}
 
-    ssize_t written_length = writen(poll_fds[current_player].fd, msg, strlen(msg));
-    if (written_length < 0) {
-        syserr("writen");
+// Function to handle events on the spectator's connection.
+static void handle_spectator(int client_fd, short revents) {
+    client_t *spectator = &clients[client_fd];
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        // Spectators don't send anything, so it can only be the end.
+        char buffer[BUF_SIZE];
+        ssize_t read_length = read(client_fd, buffer, sizeof(buffer));
+        if (read_length == 0 || (read_length < 0 && errno != EAGAIN && errno != EINTR)) {
+            save_input(client_fd, 'd', NULL);
+            remove_spectator(client_fd);
+            return;
+        }
+    }
+    if (revents & POLLOUT) {
+        if (msg_queue_flush(&spectator->out, client_fd) < 0) {
+            remove_spectator(client_fd);
+            return;
+        }
+        if (spectator->out.count == 0) {
+            set_events(client_fd, POLLIN);
+        }
     }
-    else if ((size_t) written_length != strlen(msg)) {
-        fatal("incomplete writen");
+
+    // The spectator of a finished table is closed after receiving everything.
+    if (spectator->table == NULL && !spectator->parked && spectator->out.count == 0) {
+        remove_spectator(client_fd);
     }
-    free(msg);
 }
 
-// Function to parse a "TRICK" message and react accordingly.
-static int parse_trick(char *msg) {
-    // Parse the message.
-    int ptr = strlen(msg) - 1 - strlen("\r\n");
-    char col = msg[ptr--];
-    char num = msg[ptr--];
-    if (num == '0' && msg[ptr] == '1') {
-        num = msg[ptr--];
+// Function to forget the messages of the finished deal.
+static void clear_deal_bufs(table_t *table) {
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        msgbuf_unref(table->deal_bufs[i]);
+        table->deal_bufs[i] = NULL;
     }
-    int trick_num = 0;
-    for (int i = strlen("TRICK"); i <= ptr; i++) {
-        trick_num = trick_num * 10 + (msg[i] - '0');
+    for (int i = 0; i < table->no_taken; i++) {
+        msgbuf_unref(table->taken_bufs[i]);
+        table->taken_bufs[i] = NULL;
     }
+    table->no_taken = 0;
+}
 
-    // Check if the trick is valid.
-    // Check if the player has a card in the color of first card.
-    bool has_color = false;
-    if (cards_played[current_trick][0].num != 0) {
-        for (int i = 0; i < NO_TRICKS; i++) {
-            if (game_desc[current_game].cards[current_player - 1][i].col 
-                == cards_played[current_trick][0].col) {
-                printf("%c %c\n", game_desc[current_game].cards[current_player - 1][i].num, game_desc[current_game].cards[current_player - 1][i].col);
-                has_color = true;
-                break;
-            }
-        }
+// Function to write a record describing a change of the tables. Nothing is
+// written while the tables are rebuilt from the journal.
+static void record(char const *format, ...) {
+    if (!journal_opened) {
+        return;
     }
-    if (trick_num != current_trick + 1) {
-        return -1;
-    } else if (has_color && col != cards_played[current_trick][0].col) {
-        printf("Invalid trick\n");
-        return -1;
+    char msg[BUF_SIZE];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(msg, sizeof(msg), format, args);
+    va_end(args);
+    journal_append(&journal, msg, len);
+}
+
+// Function to write the state of the table between deals.
+static void record_table(table_t *table) {
+    record("R %d %d %d %d %d %d\n", table->id, table->current_game, table->total_points[0],
+        table->total_points[1], table->total_points[2], table->total_points[3]);
+}
+
+// Function to open a new table.
+static table_t *new_table() {
+    table_t *table = calloc(1, sizeof(table_t));
+    if (table == NULL) {
+        syserr("calloc");
+    }
+    table->id = next_table_id++;
+    table->generated_game = -1;
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        hdr_init(&table->decision_latency[i], HIGHEST_LATENCY, LATENCY_FIGURES);
+    }
+    hdr_init(&table->trick_time, HIGHEST_LATENCY, LATENCY_FIGURES);
+    for (int i = 1; i <= NO_PLAYERS; i++) {
+        table->place_fds[i] = -1;
+    }
+
+    if (last_table == NULL) {
+        tables = table;
     } else {
-        for (int i = 0; i < NO_TRICKS; i++) {
-            if (game_desc[current_game].cards[current_player - 1][i].num == num &&
-                game_desc[current_game].cards[current_player - 1][i].col == col &&
-                num != 0 && col != 0) {
-                int card_id = 0;
-                while (cards_played[current_trick][card_id].num != 0) {
-                    card_id++;
-                }
-                cards_played[current_trick][card_id].num = num;
-                cards_played[current_trick][card_id].col = col;
-                game_desc[current_game].cards[current_player - 1][i].num = 0;
-                game_desc[current_game].cards[current_player - 1][i].col = 0;
-                who_played[card_id] = current_player;
-                current_player = current_player % 4 + 1;
-                return 0;
-            }
-        }
-        return -1;
+        last_table->next = table;
     }
+    last_table = table;
+    record_table(table);
+    unpark_spectators(table);
+    return table;
 }
 
-// Function to send "TAKEN" message.
-static void send_taken() {
-    int who_took = resolve(current_trick);
-    char *msg = malloc(BUF_SIZE * sizeof(char));
-    memset(msg, 0, BUF_SIZE * sizeof(char));
-    strcat(msg, "TAKEN");
-    char num[15];
-    sprintf(num, "%d", current_trick + 1);
-    strcat(msg, num);
+// Function to print the latencies measured at the table. Tables which played
+// no trick here, like the ones closed in the recovery, print nothing.
+static void print_latencies(table_t *table) {
+    if (table->trick_time.total_count == 0) {
+        return;
+    }
+    char name[BUF_SIZE];
+    printf("Latencies at table %d:\n", table->id);
     for (int i = 0; i < NO_PLAYERS; i++) {
-        msg[strlen(msg)] = cards_played[current_trick][i].num;
-        if (cards_played[current_trick][i].num == '1') {
-            msg[strlen(msg)] = '0';
-        }
-        msg[strlen(msg)] = cards_played[current_trick][i].col;
-    }
-    if (who_took == N) {
-        msg[strlen(msg)] = 'N';
-    } else if (who_took == E) {
-        msg[strlen(msg)] = 'E';
-    } else if (who_took == S) {
-        msg[strlen(msg)] = 'S';
-    } else {
-        msg[strlen(msg)] = 'W';
+        sprintf(name, "decision %c", char_of_place(i + 1));
+        hdr_print(stdout, name, &table->decision_latency[i]);
     }
-    strcat(msg, "\r\n");
+    hdr_print(stdout, "trick", &table->trick_time);
+    fflush(stdout);
+}
 
+// Function to close the table after its last deal.
+static void close_table(table_t *table) {
+    record("C %d\n", table->id);
+    print_latencies(table);
     for (int i = 1; i <= NO_PLAYERS; i++) {
-        raport(poll_fds[i].fd, msg, false);
+        if (table->place_fds[i] != -1) {
+            remove_client(table->place_fds[i]);
+        }
+    }
 
-        ssize_t written_length = writen(poll_fds[i].fd, msg, strlen(msg));
-        if (written_length < 0) {
-            syserr("writen");
+    // Spectators get the rest of their messages before closing.
+    while (table->no_spectators > 0) {
+        int client_fd = table->spectator_fds[--table->no_spectators];
+        clients[client_fd].table = NULL;
+        if (clients[client_fd].out.count == 0) {
+            remove_client(client_fd);
         }
-        else if ((size_t) written_length != strlen(msg)) {
-            fatal("incomplete writen");
+    }
+
+    table_t **prev = &tables;
+    while (*prev != table) {
+        prev = &(*prev)->next;
+    }
+    *prev = table->next;
+    if (last_table == table) {
+        last_table = NULL;
+        for (table_t *t = tables; t != NULL; t = t->next) {
+            last_table = t;
         }
     }
-    free(msg);
-    current_trick++;
-    current_player = who_took;
+
+    clear_deal_bufs(table);
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        msgbuf_unref(table->generated_msgs[i]);
+    }
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        hdr_free(&table->decision_latency[i]);
+    }
+    hdr_free(&table->trick_time);
+    free(table->spectator_fds);
+    free(table);
 }
 
-// Sends the DEAL information to all clients.
-static void send_new_deal() {
-    // Send game data.
-    char *msg = malloc(BUF_SIZE * sizeof(char));
-    for (int place_id = 1; place_id <= NO_PLAYERS; place_id++) {
-        memset(msg, 0, BUF_SIZE * sizeof(char));
-        strcat(msg, "DEAL");
-        msg[strlen(msg)] = game_desc[current_game].game_type;
-        msg[strlen(msg)] = game_desc[current_game].starting_player;
-        for (int i = 0; i < NO_TRICKS; i++) {
-            msg[strlen(msg)] = game_desc[current_game].cards[place_id - 1][i].num;
-            if (game_desc[current_game].cards[place_id - 1][i].num == '1') {
-                msg[strlen(msg)] = '0';
-            }
-            msg[strlen(msg)] = game_desc[current_game].cards[place_id - 1][i].col;
+// Function to get the current deal of the table. Generated deals are made
+// when the table gets to them, the table of number t plays the deals that
+// kierki-deal prints with the seed increased by t.
+static game_desc_t const *table_deal(table_t *table) {
+    if (no_generated == 0) {
+        return &game_desc[table->current_game];
+    }
+    if (table->generated_game != table->current_game) {
+        seeded_deal(&table->generated, deal_seed + (uint64_t) table->id,
+                    (uint64_t) table->current_game);
+        table->generated_game = table->current_game;
+        for (int place_id = 1; place_id <= NO_PLAYERS; place_id++) {
+            char msg[BUF_SIZE];
+            size_t len = format_deal(msg, &table->generated, place_id);
+            msgbuf_unref(table->generated_msgs[place_id - 1]);
+            table->generated_msgs[place_id - 1] = msgbuf_new(msg, len);
         }
-        strcat(msg, "\r\n");
+    }
+    return &table->generated;
+}
 
-        raport(poll_fds[place_id].fd, msg, false);
+// Function to determine who took the trick.
+static int resolve(table_t *table, int trick_num) {
+    int who_took = table->who_played[trick_winner(table->cards_played[trick_num], NO_PLAYERS)];
+    table->points[who_took - 1] += trick_points(table_deal(table)->game_type,
+        table->cards_played[trick_num], trick_num);
+    PROBE3(trick_resolve, table->id, trick_num + 1, who_took);
+    return who_took;
+}
 
-        ssize_t written_length = writen(poll_fds[place_id].fd, msg, strlen(msg));
-        if (written_length < 0) {
-            syserr("writen");
-        }
-        else if ((size_t) written_length != strlen(msg)) {
-            fatal("incomplete writen");
-        }
+// Function to get the DEAL message of the current deal for the place.
+static msgbuf_t *deal_msg(table_t *table, int place_id) {
+    if (no_generated != 0) {
+        table_deal(table);
+        return table->generated_msgs[place_id - 1];
     }
-    free(msg);
+    return deal_msgs[table->current_game * NO_PLAYERS + place_id - 1];
 }
 
-// Simulate the game.
-static void play() {
-    // Prepare values for the game.
-    current_trick = 0;
-    if (game_desc[current_game].starting_player == 'N') {
-        current_player = N;
-    } else if (game_desc[current_game].starting_player == 'E') {
-        current_player = E;
-    } else if (game_desc[current_game].starting_player == 'S') {
-        current_player = S;
-    } else {
-        current_player = W;
+// Function to serialize the DEAL messages of all the deals from the file
+// once, the tables only pass references to them.
+static void prepare_deal_msgs() {
+    deal_msgs = malloc((no_of_games * NO_PLAYERS + 1) * sizeof(msgbuf_t *));
+    if (deal_msgs == NULL) {
+        syserr("malloc");
     }
-    for (int i = 0; i < NO_TRICKS; i++) {
-        for (int j = 0; j < NO_PLAYERS; j++) {
-            cards_played[i][j].num = 0;
-            cards_played[i][j].col = 0;
+    for (int game = 0; game < no_of_games; game++) {
+        for (int place_id = 1; place_id <= NO_PLAYERS; place_id++) {
+            char msg[BUF_SIZE];
+            size_t len = format_deal(msg, &game_desc[game], place_id);
+            deal_msgs[game * NO_PLAYERS + place_id - 1] = msgbuf_new(msg, len);
         }
     }
-    for (int i = 0; i < NO_PLAYERS; i++) {
-        points[i] = 0;
-    }
-
-    // Send the first trick.
-    send_trick();
+}
 
-    while (current_trick < NO_TRICKS) {
-        if (ready_players < NO_PLAYERS) {
-            get_players();
+// Function to send information about ongoing game.
+static void send_game_info(table_t *table, int client_fd, int place_id) {
+    msgbuf_t *deal = deal_msg(table, place_id);
+
+    raport_buf(client_fd, deal);
+    COUNT_OUT(TYPE_DEAL, 1);
+    COUNT_OUT(TYPE_TAKEN, table->no_taken);
+    PROBE2(msg_send, client_fd, deal->data);
+    clients[client_fd].msgs_sent += 1 + table->no_taken;
+
+    // The DEAL and the tricks taken so far go out in one write.
+    struct iovec iov[1 + NO_TRICKS];
+    iov[0].iov_base = deal->data;
+    iov[0].iov_len = deal->len;
+    for (int i = 0; i < table->no_taken; i++) {
+        raport_buf(client_fd, table->taken_bufs[i]);
+        iov[1 + i].iov_base = table->taken_bufs[i]->data;
+        iov[1 + i].iov_len = table->taken_bufs[i]->len;
+    }
+    uint8_t frames[1 + NO_TRICKS][COMPACT_MAX_LEN];
+    size_t total_length = 0;
+    for (int i = 0; i <= table->no_taken; i++) {
+        if (clients[client_fd].in.compact) {
+            iov[i].iov_len = compact_encode(frames[i], iov[i].iov_base);
+            iov[i].iov_base = frames[i];
         }
+        total_length += iov[i].iov_len;
+    }
 
-        // Clear poll revents.
-        for (int i = 0; i < POLL_SIZE; i++) {
-            poll_fds[i].revents = 0;
+    if (clients[client_fd].ring.shared != NULL) {
+        if (!ring_writev(&clients[client_fd].ring, iov, 1 + table->no_taken)) {
+            shutdown(client_fd, SHUT_RDWR);
         }
+        return;
+    }
+    ssize_t written_length = writevn(client_fd, iov, 1 + table->no_taken);
+    if (written_length < 0 || (size_t) written_length != total_length) {
+        shutdown(client_fd, SHUT_RDWR);
+    }
+}
 
-        // Wait for events.
-        int ret = poll(poll_fds, POLL_SIZE, timeout * 1000);
+// Function to send "TRICK" message.
+static void send_trick(table_t *table) {
+    int current_trick = table->current_trick;
 
-        if (ret < 0) {
-            syserr("poll");
-        } else {
-            if (poll_fds[0].revents & POLLIN) {
-                // New connection: new client is accepted.
-                struct sockaddr_storage client_address;
-                int client_fd = accept(poll_fds[0].fd,
-                                       (struct sockaddr *) &client_address,
-                                       &((socklen_t){sizeof client_address}));
-                if (client_fd < 0) {
-                    syserr("accept");
-                }
+    // Send the trick.
+    char *msg = format_trick(current_trick + 1, table->cards_played[current_trick]);
 
-                char *msg = "BUSY\r\n";
+    // Latencies are measured from the first TRICK of the turn.
+    int64_t now = monotonic_ns();
+    if (table->turn_start == 0) {
+        table->turn_start = now;
+    }
+    if (table->trick_start == 0) {
+        table->trick_start = now;
+    }
 
-                raport(client_fd, msg, false);
+    // The player has the whole timeout to answer.
+    int client_fd = table->place_fds[table->current_player];
+    clients[client_fd].last_activity = current_time();
+    send_msg(client_fd, msg);
+    free(msg);
+}
 
-                ssize_t written_length = writen(client_fd, msg, strlen(msg));
-                if (written_length < 0) {
-                    syserr("writen");
-                }
-                else if ((size_t) written_length != strlen(msg)) {
-                    fatal("incomplete writen");
-                }
-            }
-            for (int i = 1; i <= NO_PLAYERS; i++) {
-                if (poll_fds[i].fd != -1) {
-                    if (poll_fds[i].revents & POLLIN) {
-                        poll_fds_info[i].last_activity = current_time();
-                        char *msg = read_msg(poll_fds[i].fd);
-                        if (msg == NULL) {
-                            // Client disconnected.
-                            close(poll_fds[i].fd);
-                            poll_fds[i].fd = -1;
-                            poll_fds_info[i].fd = -1;
-                            ready_players--;
-                            continue;
-                        }
-
-                        raport(poll_fds[i].fd, msg, true);
-
-                        if (i != current_player) {
-                            if (strncmp(msg, "TRICK", 5) == 0) {
-                                // Send the WRONG reply.
-                                free(msg);
-                                msg = malloc(BUF_SIZE * sizeof(char));
-                                memset(msg, 0, BUF_SIZE * sizeof(char));
-                                strcat(msg, "WRONG");
-                                char num[15];
-                                sprintf(num, "%d", current_trick + 1);
-                                strcat(msg, num);
-                                strcat(msg, "\r\n");
-
-                                raport(poll_fds[i].fd, msg, false);
-
-                                ssize_t written_length = writen(poll_fds[i].fd, msg, strlen(msg));
-                                if (written_length < 0) {
-                                    syserr("writen");
-                                }
-                                else if ((size_t) written_length != strlen(msg)) {
-                                    fatal("incomplete writen");
-                                }
-                                free(msg);
-                            } else {
-                                // Disconnect the client.
-                                close(poll_fds[i].fd);
-                                poll_fds[i].fd = -1;
-                                poll_fds_info[i].fd = -1;
-                                ready_players--;
-                            }
-                        } else {
-                            if (strncmp(msg, "TRICK", 5) != 0) {
-                                // Disconnect the client.
-                                close(poll_fds[i].fd);
-                                poll_fds[i].fd = -1;
-                                poll_fds_info[i].fd = -1;
-                                ready_players--;
-                            } else {
-                                // Parse the trick.
-                                int res = parse_trick(msg);
-                                free(msg);
-                                if (res == -1) {
-                                    msg = malloc(BUF_SIZE * sizeof(char));
-                                    memset(msg, 0, BUF_SIZE * sizeof(char));
-                                    strcat(msg, "WRONG");
-                                    char num[15];
-                                    sprintf(num, "%d", current_trick + 1);
-                                    strcat(msg, num);
-                                    strcat(msg, "\r\n");
-
-                                    raport(poll_fds[i].fd, msg, false);
-
-                                    ssize_t written_length = writen(poll_fds[i].fd, msg, strlen(msg));
-                                    if (written_length < 0) {
-                                        syserr("writen");
-                                    }
-                                    else if ((size_t) written_length != strlen(msg)) {
-                                        fatal("incomplete writen");
-                                    }
-                                    free(msg);
-                                } else {
-                                    if (cards_played[current_trick][NO_PLAYERS - 1].num != 0) {
-                                        // Send the TAKEN message.
-                                        send_taken();
-                                    }
-                                    if (current_trick < NO_TRICKS) {
-                                        send_trick();
-                                    }
-                                }
-                            }
-                        }
-                    } else if (i == current_player && 
-                        calculate_inactivity_duration(poll_fds_info[i].last_activity) > timeout) {
-                        send_trick();
-                    }
-                }
-            }
-        }
+// Function to send "WRONG" message. A client flooding the server gets one
+// WRONG per trick within the window, not one per line.
+static void send_wrong(table_t *table, int client_fd) {
+    client_t *client = &clients[client_fd];
+    int trick_num = table->current_trick + 1;
+    int64_t now = monotonic_ns();
+    if (wrong_window > 0 && client->wrong_trick == trick_num &&
+        now - client->wrong_time < wrong_window) {
+        COUNT(COUNTER_COALESCED_WRONGS, 1);
+        return;
     }
-    // Send the SCORE and TOTAL messages.
-    char *msg = malloc(BUF_SIZE * sizeof(char));
-    char num[15];
-    memset(msg, 0, BUF_SIZE * sizeof(char));
-    strcat(msg, "SCOREN");
-    sprintf(num, "%d", points[0]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'E';
-    sprintf(num, "%d", points[1]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'S';
-    sprintf(num, "%d", points[2]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'W';
-    sprintf(num, "%d", points[3]);
-    strcat(msg, num);
-    strcat(msg, "\r\n");
+    client->wrong_trick = trick_num;
+    client->wrong_time = now;
 
-    for (int i = 1; i <= NO_PLAYERS; i++) {
-        raport(poll_fds[i].fd, msg, true);
-        ssize_t written_length = writen(poll_fds[i].fd, msg, strlen(msg));
-        if (written_length < 0) {
-            syserr("writen");
+    char msg[BUF_SIZE];
+    format_wrong(msg, trick_num);
+    send_msg(client_fd, msg);
+}
+
+// Function to find the card in the hand, returns -1 if it isn't there.
+static int find_card(card_t const *hand, char num, char col) {
+    for (int i = 0; i < NO_TRICKS; i++) {
+        if (hand[i].num == num && hand[i].col == col && num != 0 && col != 0) {
+            return i;
         }
-        else if ((size_t) written_length != strlen(msg)) {
-            fatal("incomplete writen");
+    }
+    return -1;
+}
+
+// Function to put the card from the current player's hand on the table.
+static void play_card(table_t *table, int card_id) {
+    int current_trick = table->current_trick;
+    card_t *hand = table->hands[table->current_player - 1];
+
+    int pos = 0;
+    while (table->cards_played[current_trick][pos].num != 0) {
+        pos++;
+    }
+    table->cards_played[current_trick][pos] = hand[card_id];
+    hand[card_id].num = 0;
+    hand[card_id].col = 0;
+    table->who_played[pos] = table->current_player;
+    table->current_player = table->current_player % 4 + 1;
+}
+
+// Function to parse a "TRICK" message and react accordingly.
+static int parse_trick(table_t *table, char const *msg) {
+    int current_trick = table->current_trick;
+    int current_player = table->current_player;
+    card_t *hand = table->hands[current_player - 1];
+
+    // Parse the message.
+    card_t played;
+    int trick_num = parse_trick_msg(msg, &played);
+    char num = played.num;
+    char col = played.col;
+
+    // Check if the trick is valid.
+    // Check if the player has a card in the color of first card.
+    bool has_color = false;
+    if (table->cards_played[current_trick][0].num != 0) {
+        for (int i = 0; i < NO_TRICKS; i++) {
+            if (hand[i].col == table->cards_played[current_trick][0].col) {
+                printf("%c %c\n", hand[i].num, hand[i].col);
+                has_color = true;
+                break;
+            }
         }
     }
+    if (trick_num != current_trick + 1) {
+        return -1;
+    } else if (has_color && col != table->cards_played[current_trick][0].col) {
+        printf("Invalid trick\n");
+        return -1;
+    } else {
+        int card_id = find_card(hand, num, col);
+        if (card_id == -1) {
+            return -1;
+        }
+        char card[4];
+        card[put_card(card, hand[card_id])] = '\0';
+        record("P %d %s\n", table->id, card);
+        play_card(table, card_id);
+        return 0;
+    }
+}
+
+// Function to give the complete trick to its taker. The TAKEN message is
+// kept for the clients joining later.
+static void take_trick(table_t *table) {
+    int current_trick = table->current_trick;
+    int who_took = resolve(table, current_trick);
+    char *msg = format_taken(current_trick + 1, table->cards_played[current_trick],
+        char_of_place(who_took));
+    table->taken_bufs[current_trick] = msgbuf_new(msg, strlen(msg));
+    table->no_taken = current_trick + 1;
+    free(msg);
+    table->current_trick++;
+    table->current_player = who_took;
+}
+
+// Function to send "TAKEN" message.
+static void send_taken(table_t *table) {
+    take_trick(table);
+    if (table->trick_start != 0) {
+        hdr_record(&table->trick_time, monotonic_ns() - table->trick_start);
+        table->trick_start = 0;
+    }
+    msgbuf_t *buf = table->taken_bufs[table->no_taken - 1];
+    send_to_spectators(table, buf);
+    for (int i = 1; i <= NO_PLAYERS; i++) {
+        send_buf(table->place_fds[i], buf);
+    }
+}
+
+// Sends the DEAL information to all clients.
+static void send_new_deal(table_t *table) {
+    for (int place_id = 1; place_id <= NO_PLAYERS; place_id++) {
+        send_buf(table->place_fds[place_id], deal_msg(table, place_id));
+    }
+}
+
+// Function to send the "SCORE" or "TOTAL" message to everybody at the table.
+static void send_points(table_t *table, char const *type, int const *points) {
+    char msg[BUF_SIZE];
+    format_points(msg, type, points);
+
+    for (int i = 1; i <= NO_PLAYERS; i++) {
+        send_msg(table->place_fds[i], msg);
+    }
+
+    msgbuf_t *buf = msgbuf_new(msg, strlen(msg));
+    send_to_spectators(table, buf);
+    msgbuf_unref(buf);
+}
+
+// Function to prepare the table for the current deal.
+static void prepare_deal(table_t *table) {
+    game_desc_t const *game = table_deal(table);
+
+    // Prepare values for the game.
+    table->current_trick = 0;
+    table->current_player = place_of_char(game->starting_player);
+    memset(table->cards_played, 0, sizeof(table->cards_played));
+    memset(table->points, 0, sizeof(table->points));
+    memcpy(table->hands, game->cards, sizeof(table->hands));
+    clear_deal_bufs(table);
+    table->deal_in_progress = true;
+
+    // DEAL messages for the spectators.
+    for (int place_id = 1; place_id <= NO_PLAYERS; place_id++) {
+        table->deal_bufs[place_id - 1] = msgbuf_ref(deal_msg(table, place_id));
+    }
+}
 
+// Function to start the deal once all the players are at the table.
+static void start_deal(table_t *table) {
+    record("D %d\n", table->id);
+    prepare_deal(table);
+    PROBE2(deal_start, table->id, table->current_game);
+
+    // Show the deal to the spectators.
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        send_to_spectators(table, table->deal_bufs[i]);
+    }
+
+    // Send the first trick.
+    send_trick(table);
+}
+
+// Function to add the points of the finished deal to the total ones.
+static void score_deal(table_t *table) {
+    table->deal_in_progress = false;
+    clear_deal_bufs(table);
     for (int i = 0; i < NO_PLAYERS; i++) {
-        total_points[i] += points[i];
-    }
-
-    memset(msg, 0, BUF_SIZE * sizeof(char));
-    strcat(msg, "TOTALN");
-    sprintf(num, "%d", total_points[0]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'E';
-    sprintf(num, "%d", total_points[1]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'S';
-    sprintf(num, "%d", total_points[2]);
-    strcat(msg, num);
-    msg[strlen(msg)] = 'W';
-    sprintf(num, "%d", total_points[3]);
-    strcat(msg, num);
-    strcat(msg, "\r\n");
+        table->total_points[i] += table->points[i];
+    }
+    table->current_game++;
+}
+
+// Function to finish the deal after the last trick.
+static void finish_deal(table_t *table) {
+    record("S %d\n", table->id);
+    COUNT(COUNTER_DEALS, 1);
+    PROBE2(deal_end, table->id, table->current_game);
+
+    // Send the SCORE and TOTAL messages.
+    send_points(table, "SCORE", table->points);
+    score_deal(table);
+    send_points(table, "TOTAL", table->total_points);
+
+    if (table->current_game == no_of_games) {
+        COUNT(COUNTER_GAMES, 1);
+        close_table(table);
+    } else {
+        send_new_deal(table);
+        start_deal(table);
+    }
+}
+
+// Function to give the place at the table to the client.
+static void take_place(table_t *table, int client_fd, int place_id, bool announce) {
+    client_t *client = &clients[client_fd];
+    client->kind = CLIENT_PLAYER;
+    client->table = table;
+    client->place_id = place_id;
+    client->last_activity = current_time();
+    table->place_fds[place_id] = client_fd;
+    table->ready_players++;
+
+    if (announce) {
+        // Tell the client which place he got.
+        char msg[BUF_SIZE];
+        sprintf(msg, "IAM%c\r\n", char_of_place(place_id));
+        send_msg(client_fd, msg);
+    }
+    send_game_info(table, client_fd, place_id);
+
+    if (table->ready_players < NO_PLAYERS) {
+        // Players are not heard until the table is full.
+        set_events(client_fd, 0);
+        return;
+    }
+
+    for (int i = 1; i <= NO_PLAYERS; i++) {
+        set_events(table->place_fds[i], POLLIN);
+    }
+    input_buffered = true;
+    if (!table->deal_in_progress) {
+        start_deal(table);
+    } else {
+        // Don't make the current player wait for the retransmission.
+        COUNT(COUNTER_RETRANSMITS, 1);
+        send_trick(table);
+    }
+}
+
+// Function to free the place of a disconnected player.
+static void leave_place(int client_fd) {
+    table_t *table = clients[client_fd].table;
+    table->place_fds[clients[client_fd].place_id] = -1;
+    table->ready_players--;
+    remove_client(client_fd);
+
+    // Waiting for the place to be taken is not anyone's decision. The times
+    // are measured again from the TRICK sent when the table is full.
+    table->turn_start = 0;
+    table->trick_start = 0;
 
+    // The game waits for a new player.
     for (int i = 1; i <= NO_PLAYERS; i++) {
-        raport(poll_fds[i].fd, msg, true);
-        ssize_t written_length = writen(poll_fds[i].fd, msg, strlen(msg));
-        if (written_length < 0) {
-            syserr("writen");
+        if (table->place_fds[i] != -1) {
+            set_events(table->place_fds[i], 0);
         }
-        else if ((size_t) written_length != strlen(msg)) {
-            fatal("incomplete writen");
+    }
+}
+
+// Function to add the client at the end of the wait queue.
+static void enqueue(int client_fd, int place_id) {
+    wait_queue_t *queue = &wait_queues[place_id];
+    client_t *client = &clients[client_fd];
+    client->kind = CLIENT_WAITING;
+    client->place_id = place_id;
+    client->prev_waiting = queue->tail;
+    client->next_waiting = -1;
+    if (queue->tail == -1) {
+        queue->head = client_fd;
+    } else {
+        clients[queue->tail].next_waiting = client_fd;
+    }
+    queue->tail = client_fd;
+    queue->count++;
+}
+
+// Function to take the client out of his wait queue.
+static void dequeue(int client_fd) {
+    client_t *client = &clients[client_fd];
+    wait_queue_t *queue = &wait_queues[client->place_id];
+    if (client->prev_waiting == -1) {
+        queue->head = client->next_waiting;
+    } else {
+        clients[client->prev_waiting].next_waiting = client->next_waiting;
+    }
+    if (client->next_waiting == -1) {
+        queue->tail = client->prev_waiting;
+    } else {
+        clients[client->next_waiting].prev_waiting = client->prev_waiting;
+    }
+    queue->count--;
+}
+
+// Function to find a waiting client for the place, -1 if there is none.
+// Clients waiting for this very place go first.
+static int pop_waiting(int place_id) {
+    int client_fd = wait_queues[place_id].head;
+    if (client_fd == -1) {
+        client_fd = wait_queues[ANY].head;
+    }
+    if (client_fd != -1) {
+        dequeue(client_fd);
+    }
+    return client_fd;
+}
+
+// Function to seat the waiting clients: first at the tables which lost a
+// player, then at new tables as long as all places can be filled.
+static void match_players() {
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        for (int i = 1; i <= NO_PLAYERS && table->ready_players < NO_PLAYERS; i++) {
+            if (table->place_fds[i] == -1) {
+                int client_fd = pop_waiting(i);
+                if (client_fd != -1) {
+                    take_place(table, client_fd, i, clients[client_fd].place_id == ANY);
+                }
+            }
         }
     }
-    free(msg);
-    current_game++;
-    if (current_game < no_of_games) {
-        send_new_deal();
+
+    while (true) {
+        size_t missing = 0;
+        for (int i = 1; i <= NO_PLAYERS; i++) {
+            if (wait_queues[i].count == 0) {
+                missing++;
+            }
+        }
+        if (wait_queues[ANY].count < missing) {
+            break;
+        }
+
+        table_t *table = new_table();
+        for (int i = 1; i <= NO_PLAYERS; i++) {
+            int client_fd = pop_waiting(i);
+            take_place(table, client_fd, i, clients[client_fd].place_id == ANY);
+        }
+    }
+}
+
+// Function to check if a place for player is free.
+static int check_for_place(int client_fd, int place_id) {
+    table_t *table = tables;
+    if (table == NULL) {
+        // The last game ended earlier in this iteration, all places are gone.
+        char msg[] = "BUSYNESW\r\n";
+        send_msg(client_fd, msg);
+        return -1;
+    }
+    bool any = place_id == ANY;
+    for (int i = N; i <= W && place_id == ANY; i++) {
+        if (table->place_fds[i] == -1) {
+            place_id = i;
+        }
+    }
+    if (place_id == ANY || table->place_fds[place_id] != -1) {
+        // Send BUSY message with the taken places.
+        char *msg = malloc(BUF_SIZE * sizeof(char));
+        memset(msg, 0, BUF_SIZE * sizeof(char));
+        strcat(msg, "BUSY");
+        for (int i = N; i <= W; i++) {
+            if (table->place_fds[i] != -1) {
+                msg[strlen(msg)] = char_of_place(i);
+            }
+        }
+        strcat(msg, "\r\n");
+
+        send_msg(client_fd, msg);
+        free(msg);
+        return -1;
+    }  else {
+        take_place(table, client_fd, place_id, any);
+        return 0;
+    }
+}
+
+// Function to handle running out of descriptors while accepting. The waiting
+// connection is accepted on the spare descriptor and closed at once, so the
+// listener doesn't stay readable and poll() doesn't spin on it. Without the
+// spare one the listeners aren't polled until a client is removed. Returns
+// true if a connection was taken from the queue and there may be more.
+static bool turn_away(int server_fd) {
+    if (spare_fd == -1) {
+        accepting_paused = true;
+        set_listener_events(0);
+        return false;
+    }
+    close(spare_fd);
+    int client_fd = accept(server_fd, NULL, NULL);
+    // accept() fails for lack of descriptors even with nobody waiting.
+    bool taken = client_fd >= 0 || errno == ECONNABORTED;
+    if (client_fd >= 0) {
+        close(client_fd);
+        COUNT(COUNTER_TURNED_AWAY, 1);
+    }
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return taken;
+}
+
+// Function to accept all the clients waiting in the queue, so a burst of
+// connections doesn't take a poll() per client. They wait for their
+// introduction as pending clients. Only the listener doesn't block: the
+// messages to players are written whole, spectators switch to non-blocking
+// writes on their own.
+static void accept_clients(int server_fd) {
+    while (true) {
+        struct sockaddr_storage client_address;
+        int client_fd = accept4(server_fd, (struct sockaddr *) &client_address,
+                                &((socklen_t){sizeof client_address}), SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (turn_away(server_fd)) {
+                    continue;
+                }
+                return;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            syserr("accept");
+        }
+        if (busy_poll_us > 0) {
+            set_low_latency(client_fd, busy_poll_us);
+        }
+        add_client(client_fd, CLIENT_PENDING);
+        COUNT(COUNTER_ACCEPTED, 1);
+        PROBE1(accept, client_fd);
+        save_input(client_fd, 'c', NULL);
+    }
+}
+
+// Function to forget the client whose connection ended or who sent
+// something that can't be a message.
+static void drop_client(int client_fd) {
+    save_input(client_fd, 'd', NULL);
+    switch (clients[client_fd].kind) {
+    case CLIENT_PENDING:
+        printf("Client disconnected\n");
+        remove_client(client_fd);
+        break;
+    case CLIENT_WAITING:
+        dequeue(client_fd);
+        remove_client(client_fd);
+        break;
+    case CLIENT_PLAYER:
+        leave_place(client_fd);
+        if (lobby_mode) {
+            match_players();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Function to count a message the client shouldn't have sent. Returns true
+// if he went over the limit and was dropped.
+static bool add_strike(int client_fd) {
+    if (max_strikes == 0 || ++clients[client_fd].strikes <= max_strikes) {
+        return false;
+    }
+    COUNT(COUNTER_FLOOD_DISCONNECTS, 1);
+    drop_client(client_fd);
+    return true;
+}
+
+// Function to take a token for a message from the client's bucket, which
+// fills up at msg_rate tokens per second up to a second's worth. Returns
+// false if it is empty, then the message is dropped unhandled.
+static bool take_token(int client_fd) {
+    if (msg_rate == 0) {
+        return true;
+    }
+    client_t *client = &clients[client_fd];
+    int64_t now = monotonic_ns();
+    client->tokens += (double) (now - client->tokens_time) * msg_rate / 1e9;
+    if (client->tokens > (double) msg_rate) {
+        client->tokens = (double) msg_rate;
+    }
+    client->tokens_time = now;
+    if (client->tokens < 1) {
+        return false;
+    }
+    client->tokens--;
+    return true;
+}
+
+// Function to move the connection to shared memory: the segment goes to the
+// client over its Unix socket, which stays open to wake the sides up and to
+// notice the end of the connection. Returns false if that's impossible.
+static bool share_ring(int client_fd) {
+    int memfd = ring_create(&clients[client_fd].ring, client_fd);
+    if (memfd < 0) {
+        return false;
+    }
+    char reply = RING_SUFFIX;
+    if (send_with_fd(client_fd, &reply, 1, memfd) != 1) {
+        ring_free(&clients[client_fd].ring);
+        return false;
+    }
+    return true;
+}
+
+// Function to find the table of the given number.
+static table_t *find_table(int id) {
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        if (table->id == id) {
+            return table;
+        }
+    }
+    return NULL;
+}
+
+// Function to handle "WATCH<table number>", or "WATCH" for the oldest table.
+// In the lobby a table may open later, then the spectator waits for it.
+static void handle_watch(int client_fd, char const *id_str) {
+    int table_id = -1;
+    int id_len = 0;
+    if (strcmp(id_str, "\r\n") != 0 &&
+        (sscanf(id_str, "%9d%n", &table_id, &id_len) != 1 || table_id < 0 ||
+         id_str[0] < '0' || id_str[0] > '9' || strcmp(id_str + id_len, "\r\n") != 0)) {
+        remove_client(client_fd);
+        return;
+    }
+
+    table_t *table = table_id == -1 ? tables : find_table(table_id);
+    if (table != NULL) {
+        add_spectator(table, client_fd, true);
+    } else if (lobby_mode && (table_id == -1 || table_id >= next_table_id)) {
+        park_spectator(client_fd, table_id == -1 ? next_table_id : table_id);
+    } else {
+        // The table is already closed.
+        remove_client(client_fd);
+    }
+}
+
+// Function to handle the introduction of a new client.
+static void handle_pending(int client_fd, char *msg) {
+    int place_id = -1;
+    bool ring = false;
+    if (strncmp(msg, "IAM", 3) == 0 && msg[3] != '\0') {
+        // The place may be followed by the suffixes of the compact form and
+        // of the shared memory, in this order.
+        char *suffix = msg + 4;
+        bool compact = *suffix == COMPACT_SUFFIX;
+        suffix += compact;
+        ring = *suffix == RING_SUFFIX;
+        suffix += ring;
+        if (strcmp(suffix, "\r\n") == 0) {
+            // Everything after this message goes in the asked form. The
+            // recording keeps the text one, so the session replays in text.
+            place_id = place_of_char(msg[3]);
+            clients[client_fd].in.compact = compact && place_id != -1;
+            memmove(msg + 4, suffix, strlen(suffix) + 1);
+        }
+    }
+    save_input(client_fd, 'm', msg);
+    if (place_id != -1 && ring && !share_ring(client_fd)) {
+        remove_client(client_fd);
+    } else if (place_id != -1 && lobby_mode) {
+        enqueue(client_fd, place_id);
+        match_players();
+    } else if (place_id != -1) {
+        if (check_for_place(client_fd, place_id) == -1) {
+            remove_client(client_fd);
+        }
+    } else if (strncmp(msg, "WATCH", 5) == 0) {
+        handle_watch(client_fd, msg + 5);
+    } else {
+        remove_client(client_fd);
+    }
+}
+
+// Function to handle a message from a client waiting in the lobby.
+static void handle_waiting(int client_fd, char const *msg) {
+    // There is nothing to say before getting a place.
+    save_input(client_fd, 'm', msg);
+    dequeue(client_fd);
+    remove_client(client_fd);
+}
+
+// Function to check if the "TRICK" message repeats a card the player has
+// already put on the table in this deal, e.g. answering the TRICK sent again
+// after a timeout.
+static bool is_repeated_trick(table_t *table, int place_id, char const *msg) {
+    card_t card;
+    int trick_num = parse_trick_msg(msg, &card);
+    if (!table->deal_in_progress || trick_num < 1 || trick_num > table->current_trick + 1 ||
+        trick_num > NO_TRICKS) {
+        return false;
+    }
+    card_t const *dealt = table_deal(table)->cards[place_id - 1];
+    if (find_card(dealt, card.num, card.col) == -1) {
+        return false;
+    }
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        card_t played = table->cards_played[trick_num - 1][i];
+        if (played.num == card.num && played.col == card.col) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to handle a message from a player. Messages of a player who is
+// not on the move get WRONG, repeated cards are ignored.
+static void handle_player(int client_fd, char const *msg) {
+    table_t *table = clients[client_fd].table;
+    int place_id = clients[client_fd].place_id;
+
+    clients[client_fd].last_activity = current_time();
+    save_input(client_fd, 'm', msg);
+
+    if (strncmp(msg, "TRICK", 5) != 0) {
+        // Disconnect the client.
+        leave_place(client_fd);
+        if (lobby_mode) {
+            match_players();
+        }
+        return;
+    }
+
+    if (is_repeated_trick(table, place_id, msg)) {
+        COUNT(COUNTER_REPEATED_TRICKS, 1);
+    } else if (place_id != table->current_player || parse_trick(table, msg) == -1) {
+        if (!add_strike(client_fd)) {
+            send_wrong(table, client_fd);
+        }
+    } else {
+        clients[client_fd].strikes = 0;
+        if (table->turn_start != 0) {
+            hdr_record(&table->decision_latency[place_id - 1],
+                       monotonic_ns() - table->turn_start);
+            table->turn_start = 0;
+        }
+        if (table->cards_played[table->current_trick][NO_PLAYERS - 1].num != 0) {
+            // Send the TAKEN message.
+            send_taken(table);
+        }
+        if (table->current_trick < NO_TRICKS) {
+            send_trick(table);
+        } else {
+            finish_deal(table);
+        }
+    }
+}
+
+// Function to check if the messages of the client are handled now. Players
+// are not heard until their table is full.
+static bool is_heard(int client_fd) {
+    client_t const *client = &clients[client_fd];
+    return client->kind == CLIENT_PENDING || client->kind == CLIENT_WAITING ||
+        (client->kind == CLIENT_PLAYER && client->table->ready_players == NO_PLAYERS);
+}
+
+// Function to handle the complete messages received from the client, in
+// order, as long as he is heard. The rest stays in the buffer.
+static void handle_messages(int client_fd) {
+    char text[BUF_SIZE];
+    char *msg;
+    size_t msg_len;
+    while (is_heard(client_fd) && (msg = frame_next(&clients[client_fd].in, &msg_len)) != NULL) {
+        if (!take_token(client_fd)) {
+            COUNT(COUNTER_THROTTLED, 1);
+            if (add_strike(client_fd)) {
+                return;
+            }
+            continue;
+        }
+        if (clients[client_fd].in.compact) {
+            if (compact_decode(text, (uint8_t const *) msg, msg_len) == 0) {
+                drop_client(client_fd);
+                return;
+            }
+            msg = text;
+        }
+        raport(client_fd, msg, true);
+        COUNT_IN(msg_type(msg));
+        PROBE2(msg_recv, client_fd, msg);
+
+        switch (clients[client_fd].kind) {
+        case CLIENT_PENDING:
+            handle_pending(client_fd, msg);
+            break;
+        case CLIENT_WAITING:
+            handle_waiting(client_fd, msg);
+            break;
+        default:
+            handle_player(client_fd, msg);
+            break;
+        }
+    }
+}
+
+// Function to receive what the client sent and handle all the complete
+// messages, so a burst of them doesn't wait for the next poll(). A ring is
+// emptied, as the client won't wake us up again before that.
+static void handle_input(int client_fd) {
+    client_t *client = &clients[client_fd];
+    bool more = true;
+    while (more) {
+        ssize_t read_length = client->ring.shared != NULL ?
+            ring_fill(&client->ring, &client->in) : frame_fill(&client->in, client_fd);
+        if (read_length < 0 && (errno == EINTR || errno == EAGAIN)) {
+            return;
+        }
+        if (read_length <= 0) {
+            drop_client(client_fd);
+            return;
+        }
+        more = client->ring.shared != NULL && client->in.end == BUF_SIZE;
+        handle_messages(client_fd);
+        more = more && client->kind != CLIENT_NONE && is_heard(client_fd);
+    }
+}
+
+// Function to handle the messages held back in the buffers while the tables
+// were waiting for players.
+static void handle_buffered_input() {
+    while (input_buffered) {
+        input_buffered = false;
+        for (size_t i = no_poll_fds; i-- > 0;) {
+            if (i < no_poll_fds) {
+                handle_messages(poll_fds[i].fd);
+            }
+        }
+    }
+}
+
+// Function to apply one journal record. Returns false if it is invalid.
+static bool replay_record(char const *line) {
+    int id;
+    if (sscanf(line + 1, "%d", &id) != 1) {
+        return false;
     }
+    table_t *table = find_table(id);
+
+    if (line[0] == 'R') {
+        int game;
+        int totals[NO_PLAYERS];
+        if (sscanf(line, "R %d %d %d %d %d %d", &id, &game, &totals[0], &totals[1],
+                   &totals[2], &totals[3]) != 6 || game < 0 || game >= no_of_games) {
+            return false;
+        }
+        if (table == NULL) {
+            table = new_table();
+            table->id = id;
+        }
+        clear_deal_bufs(table);
+        table->deal_in_progress = false;
+        table->current_game = game;
+        memcpy(table->total_points, totals, sizeof(totals));
+    } else if (table == NULL) {
+        return false;
+    } else if (line[0] == 'D') {
+        prepare_deal(table);
+    } else if (line[0] == 'P') {
+        char card_str[4];
+        card_t card;
+        if (!table->deal_in_progress || table->current_trick == NO_TRICKS ||
+            sscanf(line, "P %d %3s", &id, card_str) != 2 || parse_card(card_str, &card) == 0) {
+            return false;
+        }
+        int card_id = find_card(table->hands[table->current_player - 1], card.num, card.col);
+        if (card_id == -1) {
+            return false;
+        }
+        play_card(table, card_id);
+        if (table->cards_played[table->current_trick][NO_PLAYERS - 1].num != 0) {
+            take_trick(table);
+        }
+    } else if (line[0] == 'S') {
+        if (!table->deal_in_progress || table->current_trick != NO_TRICKS) {
+            return false;
+        }
+        score_deal(table);
+    } else if (line[0] == 'C') {
+        close_table(table);
+    } else {
+        return false;
+    }
+    return true;
 }
 
+// Function to write the records rebuilding the table in its current state.
+// Returns the length of the description.
+static size_t describe_table(table_t *table, char *desc) {
+    size_t len = sprintf(desc, "R %d %d %d %d %d %d\n", table->id, table->current_game,
+        table->total_points[0], table->total_points[1], table->total_points[2],
+        table->total_points[3]);
+    if (!table->deal_in_progress) {
+        return len;
+    }
+    len += sprintf(desc + len, "D %d\n", table->id);
+    for (int i = 0; i <= table->current_trick && i < NO_TRICKS; i++) {
+        for (int j = 0; j < NO_PLAYERS && table->cards_played[i][j].num != 0; j++) {
+            char card[4];
+            card[put_card(card, table->cards_played[i][j])] = '\0';
+            len += sprintf(desc + len, "P %d %s\n", table->id, card);
+        }
+    }
+    return len;
+}
 
+// Function to rebuild the tables from the journal left by the previous run.
+static void recover(char const *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return;
+        }
+        syserr("fopen %s", path);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_len;
+    int line_num = 0;
+    while ((line_len = getline(&line, &line_capacity, file)) > 0) {
+        line_num++;
+        if (line[line_len - 1] != '\n') {
+            // The last record was being written when the server died.
+            break;
+        }
+        if (!replay_record(line)) {
+            fatal("Invalid record in line %d of the journal", line_num);
+        }
+    }
+    free(line);
+    fclose(file);
+
+    // Finish what the server didn't manage to write down.
+    table_t *table = tables;
+    while (table != NULL) {
+        table_t *next = table->next;
+        if (table->deal_in_progress && table->current_trick == NO_TRICKS) {
+            score_deal(table);
+        }
+        if (table->current_game == no_of_games) {
+            close_table(table);
+        } else if (table->id >= next_table_id) {
+            next_table_id = table->id + 1;
+        }
+        table = next;
+    }
+}
+
+// Function to start a new journal describing the recovered tables. It
+// replaces the old one only when it is safely on the disk.
+static void open_journal() {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal_path) >= PATH_MAX) {
+        fatal("Journal path too long");
+    }
+    journal_open(&journal, tmp_path);
+    journal_opened = true;
+
+    char desc[TABLE_DESC_SIZE];
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        journal_append(&journal, desc, describe_table(table, desc));
+    }
+    journal_sync(&journal);
+
+    if (rename(tmp_path, journal_path) < 0) {
+        syserr("rename");
+    }
+}
+
+// Function to create the socket on which the next server asks for the clients.
+static int prepare_handoff() {
+    int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        syserr("cannot create a socket");
+    }
+
+    // The socket may be left by the server we took over from.
+    struct sockaddr_un address = get_unix_address(handoff_path);
+    unlink(handoff_path);
+    if (bind(socket_fd, (struct sockaddr *) &address, (socklen_t) sizeof(address)) < 0) {
+        syserr("bind");
+    }
+    if (listen(socket_fd, 1) < 0) {
+        syserr("listen");
+    }
+    return socket_fd;
+}
+
+// Function to send one handoff record with an optional descriptor.
+static bool send_record(int conn_fd, char const *msg, size_t len, int fd) {
+    ssize_t sent = send_with_fd(conn_fd, msg, len, fd);
+    return sent >= 0 && (size_t) sent == len;
+}
+
+// Function to pass the spectator with the messages he didn't get yet.
+static bool send_spectator(int conn_fd, int client_fd) {
+    client_t *spectator = &clients[client_fd];
+    if (msg_queue_flush(&spectator->out, client_fd) < 0) {
+        // Nothing to pass, the connection is broken.
+        return true;
+    }
+
+    char msg[BUF_SIZE + 1];
+    int len = spectator->parked ? sprintf(msg, "v %d", spectator->watched_id) :
+        sprintf(msg, "w %d", spectator->table == NULL ? -1 : spectator->table->id);
+    if (!send_record(conn_fd, msg, len, client_fd)) {
+        return false;
+    }
+    for (size_t i = 0; i < spectator->out.count; i++) {
+        msgbuf_t *buf = spectator->out.bufs[(spectator->out.head + i) % spectator->out.capacity];
+        size_t skip = i == 0 ? spectator->out.offset : 0;
+        msg[0] = 'o';
+        memcpy(msg + 1, buf->data + skip, buf->len - skip);
+        if (!send_record(conn_fd, msg, buf->len - skip + 1, -1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Function to pass what the client sent, but wasn't handled yet.
+static bool send_input(int conn_fd, int client_fd) {
+    size_t len;
+    char const *rest = frame_rest(&clients[client_fd].in, &len);
+    if (len == 0) {
+        return true;
+    }
+    char msg[BUF_SIZE + 1];
+    msg[0] = 'i';
+    memcpy(msg + 1, rest, len);
+    return send_record(conn_fd, msg, len + 1, -1);
+}
+
+// Function to pass the shared memory of the client, if he uses it. What is
+// in the rings stays there for the next server.
+static bool send_ring(int conn_fd, int client_fd) {
+    return clients[client_fd].ring.shared == NULL ||
+        send_record(conn_fd, "r", 1, clients[client_fd].ring.memfd);
+}
+
+// Function to pass all the connections and the state of the tables to the
+// server taking over, then exit. Returns only if the handoff failed.
+static void hand_off(int handoff_fd) {
+    int conn_fd = accept(handoff_fd, NULL, NULL);
+    if (conn_fd < 0) {
+        if (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED) {
+            return;
+        }
+        syserr("accept");
+    }
+
+    // The tables are described the same way as in the journal.
+    bool sent = true;
+    char msg[TABLE_DESC_SIZE];
+    for (table_t *table = tables; table != NULL && sent; table = table->next) {
+        sent = send_record(conn_fd, msg, describe_table(table, msg), -1);
+    }
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        for (int i = 1; i <= NO_PLAYERS && sent; i++) {
+            int client_fd = table->place_fds[i];
+            if (client_fd != -1) {
+                int len = sprintf(msg, "p %d %d %lld %d", table->id, i,
+                    (long long) clients[client_fd].last_activity, clients[client_fd].in.compact);
+                sent = send_record(conn_fd, msg, len, client_fd) &&
+                    send_input(conn_fd, client_fd) && send_ring(conn_fd, client_fd);
+            }
+        }
+    }
+    for (size_t i = 0; i < no_poll_fds && sent; i++) {
+        if (clients[poll_fds[i].fd].kind == CLIENT_SPECTATOR) {
+            sent = send_spectator(conn_fd, poll_fds[i].fd);
+        }
+    }
+    for (int i = 0; i <= NO_PLAYERS; i++) {
+        for (int client_fd = wait_queues[i].head; client_fd != -1 && sent;
+             client_fd = clients[client_fd].next_waiting) {
+            int len = sprintf(msg, "q %d %lld %d", i, (long long) clients[client_fd].last_activity,
+                clients[client_fd].in.compact);
+            sent = send_record(conn_fd, msg, len, client_fd) && send_input(conn_fd, client_fd) &&
+                send_ring(conn_fd, client_fd);
+        }
+    }
+    for (size_t i = 0; i < no_poll_fds && sent; i++) {
+        client_t *client = &clients[poll_fds[i].fd];
+        if (client->kind == CLIENT_PENDING) {
+            int len = sprintf(msg, "n %lld", (long long) client->last_activity);
+            sent = send_record(conn_fd, msg, len, poll_fds[i].fd) &&
+                send_input(conn_fd, poll_fds[i].fd);
+        } else if (client->kind == CLIENT_LISTENER) {
+            sent = send_record(conn_fd, "L", 1, poll_fds[i].fd);
+        } else if (client->kind == CLIENT_METRICS) {
+            sent = send_record(conn_fd, "M", 1, poll_fds[i].fd);
+        }
+    }
+    if (sent) {
+        int len = sprintf(msg, "T %d", next_table_id);
+        sent = send_record(conn_fd, msg, len, -1) && send_record(conn_fd, "E", 1, -1);
+    }
+
+    // The clients are ours until the next server confirms it has them all.
+    if (!sent || read(conn_fd, msg, sizeof(msg)) != 1 || msg[0] != 'A') {
+        printf("Handoff failed\n");
+        close(conn_fd);
+        return;
+    }
+    if (journal_opened) {
+        journal_close(&journal);
+    }
+    exit(0);
+}
+
+// Function to apply one handoff record, using the descriptor passed with it.
+// Returns false if it is invalid.
+static bool take_over_record(char *msg, size_t len, int fd, int *last_client) {
+    long long last_activity;
+    int id;
+    int place_id;
+    int compact;
+
+    if (msg[0] == 'R') {
+        // Description of a table, one journal record per line.
+        char *line = msg;
+        while (*line != '\0') {
+            char *end = strchr(line, '\n');
+            if (end == NULL || !replay_record(line)) {
+                return false;
+            }
+            line = end + 1;
+        }
+        return fd == -1;
+    } else if (msg[0] == 'o') {
+        if (*last_client == -1 || fd != -1 || clients[*last_client].kind != CLIENT_SPECTATOR) {
+            return false;
+        }
+        msgbuf_t *buf = msgbuf_new(msg + 1, len - 1);
+        msg_queue_push(&clients[*last_client].out, buf);
+        msgbuf_unref(buf);
+        set_events(*last_client, POLLIN | POLLOUT);
+        return true;
+    } else if (msg[0] == 'i') {
+        // Received from the last client, but not handled yet.
+        if (*last_client == -1 || fd != -1) {
+            return false;
+        }
+        frame_buf_t *in = &clients[*last_client].in;
+        if (len - 1 > BUF_SIZE - in->end) {
+            return false;
+        }
+        memcpy(in->data + in->end, msg + 1, len - 1);
+        in->end += len - 1;
+        input_buffered = true;
+        return true;
+    } else if (msg[0] == 'T') {
+        return fd == -1 && sscanf(msg, "T %d", &next_table_id) == 1;
+    } else if (msg[0] == 'E') {
+        return fd == -1;
+    } else if (fd == -1) {
+        return false;
+    }
+
+    if (msg[0] == 'p') {
+        if (sscanf(msg, "p %d %d %lld %d", &id, &place_id, &last_activity, &compact) != 4) {
+            return false;
+        }
+        table_t *table = find_table(id);
+        if (table == NULL || place_id < N || place_id > W || table->place_fds[place_id] != -1) {
+            return false;
+        }
+        add_client(fd, CLIENT_PLAYER);
+        clients[fd].table = table;
+        clients[fd].place_id = place_id;
+        clients[fd].last_activity = (time_t) last_activity;
+        clients[fd].in.compact = compact;
+        table->place_fds[place_id] = fd;
+        table->ready_players++;
+        *last_client = fd;
+    } else if (msg[0] == 'w') {
+        if (sscanf(msg, "w %d", &id) != 1) {
+            return false;
+        }
+        table_t *table = find_table(id);
+        if (table == NULL && id != -1) {
+            return false;
+        }
+        add_client(fd, CLIENT_SPECTATOR);
+        if (table != NULL) {
+            add_spectator(table, fd, false);
+        }
+        *last_client = fd;
+    } else if (msg[0] == 'v') {
+        // Spectator of a table not opened yet.
+        if (sscanf(msg, "v %d", &id) != 1 || id < 0 || find_table(id) != NULL) {
+            return false;
+        }
+        add_client(fd, CLIENT_SPECTATOR);
+        park_spectator(fd, id);
+        *last_client = fd;
+    } else if (msg[0] == 'q') {
+        if (sscanf(msg, "q %d %lld %d", &place_id, &last_activity, &compact) != 3 ||
+            place_id < ANY || place_id > W) {
+            return false;
+        }
+        add_client(fd, CLIENT_WAITING);
+        clients[fd].last_activity = (time_t) last_activity;
+        clients[fd].in.compact = compact;
+        enqueue(fd, place_id);
+        *last_client = fd;
+    } else if (msg[0] == 'n') {
+        if (sscanf(msg, "n %lld", &last_activity) != 1) {
+            return false;
+        }
+        add_client(fd, CLIENT_PENDING);
+        clients[fd].last_activity = (time_t) last_activity;
+        *last_client = fd;
+    } else if (msg[0] == 'r') {
+        // Shared memory of the last player or waiting client.
+        if (*last_client == -1 || clients[*last_client].ring.shared != NULL ||
+            (clients[*last_client].kind != CLIENT_PLAYER &&
+             clients[*last_client].kind != CLIENT_WAITING) ||
+            !ring_map(&clients[*last_client].ring, fd, *last_client, true)) {
+            return false;
+        }
+    } else if (msg[0] == 'L') {
+        // Servers before the accept batching passed a blocking socket.
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            return false;
+        }
+        add_client(fd, CLIENT_LISTENER);
+    } else if (msg[0] == 'M') {
+        add_client(fd, CLIENT_METRICS);
+        metrics_listening = true;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Function to take the clients and the tables over from the running server.
+static void take_over(char const *path) {
+    int conn_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (conn_fd < 0) {
+        syserr("cannot create a socket");
+    }
+    struct sockaddr_un address = get_unix_address(path);
+    if (connect(conn_fd, (struct sockaddr *) &address, (socklen_t) sizeof(address)) < 0) {
+        syserr("cannot connect to %s", path);
+    }
+
+    char msg[TABLE_DESC_SIZE + 1];
+    int last_client = -1;
+    do {
+        int fd;
+        ssize_t len = recv_with_fd(conn_fd, msg, TABLE_DESC_SIZE, &fd);
+        if (len <= 0) {
+            fatal("Handoff interrupted");
+        }
+        msg[len] = '\0';
+        if (!take_over_record(msg, len, fd, &last_client)) {
+            fatal("Invalid handoff record: %s", msg);
+        }
+    } while (msg[0] != 'E');
+
+    // Players are heard only at full tables.
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        for (int i = 1; i <= NO_PLAYERS; i++) {
+            if (table->place_fds[i] != -1) {
+                set_events(table->place_fds[i],
+                    table->ready_players == NO_PLAYERS ? POLLIN : 0);
+            }
+        }
+    }
+
+    // The previous server leaves its socket behind, it won't need it.
+    unlink(path);
+    if (write(conn_fd, "A", 1) != 1) {
+        syserr("write");
+    }
+    close(conn_fd);
+}
+
+// Function to create a listening Unix stream socket, replacing whatever a
+// previous run left at the path.
+static int prepare_unix_listener(char const *path) {
+    int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        syserr("cannot create a socket");
+    }
+    struct sockaddr_un address = get_unix_address(path);
+    unlink(path);
+    if (bind(socket_fd, (struct sockaddr *) &address, (socklen_t) sizeof(address)) < 0) {
+        syserr("bind");
+    }
+    if (listen(socket_fd, queue_length) < 0) {
+        syserr("listen");
+    }
+    return socket_fd;
+}
+
+// Function to create the socket for metrics scrapers, the address is either
+// a port or a Unix socket path.
+static int prepare_metrics() {
+    if (strchr(metrics_address, '/') == NULL) {
+        return prepare_connection(read_port(metrics_address));
+    }
+    return prepare_unix_listener(metrics_address);
+}
+
+// Function to accept a scraper and wait for his request.
+static void accept_scraper(int metrics_fd) {
+    int client_fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            turn_away(metrics_fd);
+            return;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+            return;
+        }
+        syserr("accept");
+    }
+    add_client(client_fd, CLIENT_SCRAPER);
+}
+
+// Function to handle events on the scraper's connection. Once the request
+// ends with an empty line, whatever he asked for, he gets the metrics in the
+// Prometheus text format. The answer is queued like the spectators' messages,
+// so a slow scraper doesn't hold up the game.
+static void handle_scraper(int client_fd) {
+    client_t *scraper = &clients[client_fd];
+    if (scraper->out.count > 0) {
+        if (msg_queue_flush(&scraper->out, client_fd) < 0 || scraper->out.count == 0) {
+            remove_client(client_fd);
+        }
+        return;
+    }
+
+    ssize_t read_length = frame_fill(&scraper->in, client_fd);
+    if (read_length < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (read_length <= 0 || scraper->in.end == BUF_SIZE) {
+        remove_client(client_fd);
+        return;
+    }
+    char const *request = scraper->in.data + scraper->in.start;
+    size_t request_len = scraper->in.end - scraper->in.start;
+    if (memmem(request, request_len, "\r\n\r\n", 4) == NULL &&
+        memmem(request, request_len, "\n\n", 2) == NULL) {
+        return;
+    }
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *file = open_memstream(&body, &body_len);
+    if (file == NULL) {
+        syserr("open_memstream");
+    }
+
+    // Gauges are computed from the state of the server.
+    static char const *kind_names[] = {
+        [CLIENT_PENDING] = "pending", [CLIENT_WAITING] = "waiting",
+        [CLIENT_PLAYER] = "player", [CLIENT_SPECTATOR] = "spectator",
+    };
+    size_t kind_counts[CLIENT_SPECTATOR + 1] = {0};
+    for (size_t i = 0; i < no_poll_fds; i++) {
+        client_kind_t kind = clients[poll_fds[i].fd].kind;
+        if (kind <= CLIENT_SPECTATOR) {
+            kind_counts[kind]++;
+        }
+    }
+    fprintf(file, "# HELP kierki_connections Open connections by kind.\n"
+        "# TYPE kierki_connections gauge\n");
+    for (int kind = CLIENT_PENDING; kind <= CLIENT_SPECTATOR; kind++) {
+        fprintf(file, "kierki_connections{kind=\"%s\"} %zu\n", kind_names[kind], kind_counts[kind]);
+    }
+    size_t no_tables = 0;
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        no_tables++;
+    }
+    fprintf(file, "# HELP kierki_tables Open tables.\n# TYPE kierki_tables gauge\n"
+        "kierki_tables %zu\n", no_tables);
+    metrics_write(file);
+    fclose(file);
+
+    char header[BUF_SIZE];
+    int header_len = sprintf(header, "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+    msgbuf_t *header_buf = msgbuf_new(header, header_len);
+    msgbuf_t *body_buf = msgbuf_new(body, body_len);
+    msg_queue_push(&scraper->out, header_buf);
+    msg_queue_push(&scraper->out, body_buf);
+    msgbuf_unref(header_buf);
+    msgbuf_unref(body_buf);
+    free(body);
+    if (msg_queue_flush(&scraper->out, client_fd) < 0 || scraper->out.count == 0) {
+        remove_client(client_fd);
+    } else {
+        set_events(client_fd, POLLOUT);
+    }
+}
+
+// Function to handle the signal asking for the latencies.
+static void request_dump(int signal) {
+    (void) signal;
+    dump_requested = 1;
+}
+
+// Function to print the latencies measured so far at the open tables.
+static void print_open_latencies() {
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        print_latencies(table);
+    }
+}
+
+// Function to drop the pending clients who didn't introduce themselves in
+// time and the silent scrapers, and remind the players about their turn.
+// Returns the time in milliseconds until the next check.
+static int check_timeouts() {
+    time_t now = current_time();
+    time_t next_check = 0;
+
+    for (size_t i = 0; i < no_poll_fds; i++) {
+        int client_fd = poll_fds[i].fd;
+        if (clients[client_fd].kind != CLIENT_PENDING &&
+            clients[client_fd].kind != CLIENT_SCRAPER) {
+            continue;
+        }
+        // A pending client's activity is his connecting, partial lines
+        // don't give him more time.
+        bool pending = clients[client_fd].kind == CLIENT_PENDING;
+        time_t client_timeout = pending ? iam_timeout : timeout;
+        if (calculate_inactivity_duration(clients[client_fd].last_activity) > client_timeout) {
+            if (pending) {
+                COUNT(COUNTER_PENDING_TIMEOUTS, 1);
+                PROBE3(timeout, -1, 0, client_fd);
+            }
+            remove_client(client_fd);
+            i--;
+            continue;
+        }
+        time_t deadline = clients[client_fd].last_activity + client_timeout + 1;
+        if (next_check == 0 || deadline < next_check) {
+            next_check = deadline;
+        }
+    }
+
+    for (table_t *table = tables; table != NULL; table = table->next) {
+        if (!table->deal_in_progress || table->ready_players < NO_PLAYERS) {
+            continue;
+        }
+        int client_fd = table->place_fds[table->current_player];
+        if (calculate_inactivity_duration(clients[client_fd].last_activity) > timeout) {
+            COUNT(COUNTER_PLAYER_TIMEOUTS, 1);
+            COUNT(COUNTER_RETRANSMITS, 1);
+            PROBE3(timeout, table->id, table->current_player, client_fd);
+            send_trick(table);
+        }
+        time_t deadline = clients[client_fd].last_activity + timeout + 1;
+        if (next_check == 0 || deadline < next_check) {
+            next_check = deadline;
+        }
+    }
+
+    if (next_check == 0) {
+        return -1;
+    }
+    return next_check > now ? (int) (next_check - now) * 1000 : 0;
+}
 
 int main(int argc, char *argv[]) {
     parse_args(argc, argv);
 
-    parse_game_file();
+    if (pinned_cpu != -1) {
+        pin_to_cpu(pinned_cpu);
+    }
+    if (no_generated != 0) {
+        no_of_games = (int) no_generated;
+    } else {
+        game_desc = load_game_file(game_file, &no_of_games);
+        prepare_deal_msgs();
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (spare_fd < 0) {
+        syserr("open");
+    }
 
-    int server_fd = prepare_connection();
+    // Broken connections are handled where they are noticed.
+    install_signal_handler(SIGPIPE, SIG_IGN, 0);
+    install_signal_handler(SIGUSR1, request_dump, 0);
 
-    for (int i = 0; i < NO_PLAYERS; i++) {
-        total_points[i] = 0;
+    for (int i = 0; i <= NO_PLAYERS; i++) {
+        wait_queues[i].head = -1;
+        wait_queues[i].tail = -1;
     }
 
-    // Initialize poll structure.
-    for (int i = 0; i < POLL_SIZE; i++) {
-        poll_fds[i].fd = -1;
-        poll_fds_info[i].fd = -1;
+    // The server we take over from passes the listening socket too.
+    if (takeover_path != NULL) {
+        take_over(takeover_path);
+    } else {
+        if (journal_path != NULL) {
+            recover(journal_path);
+        }
+        add_client(prepare_connection(port), CLIENT_LISTENER);
+        if (unix_path != NULL) {
+            // Clients on this host can skip the TCP/IP stack.
+            add_client(prepare_unix_listener(unix_path), CLIENT_LISTENER);
+        }
+    }
+    if (journal_path != NULL) {
+        open_journal();
+    }
+    if (handoff_path != NULL) {
+        add_client(prepare_handoff(), CLIENT_HANDOFF);
+    }
+    if (metrics_address != NULL && !metrics_listening) {
+        add_client(prepare_metrics(), CLIENT_METRICS);
+    }
+    if (recording_path != NULL) {
+        recording = fopen(recording_path, "w");
+        if (recording == NULL) {
+            syserr("fopen %s", recording_path);
+        }
+        recording_start = monotonic_ns();
     }
-    poll_fds[0].fd = server_fd;
-    poll_fds[0].events = POLLIN;
-    poll_fds_info[0].fd = server_fd;
 
-    // Main game loop for tracking game progress.
-    for (int i = 0; i < no_of_games; i++) {
-        get_players();
-        play();
+    // Without the lobby all the clients play at one table.
+    if (!lobby_mode && no_of_games > 0 && tables == NULL) {
+        new_table();
     }
 
-    for (int i = 1; i <= NO_PLAYERS; i++) {
-        close(poll_fds[i].fd);
+    // Main loop for tracking game progress.
+    while (lobby_mode || tables != NULL) {
+        if (dump_requested) {
+            dump_requested = 0;
+            print_open_latencies();
+        }
+        int poll_timeout = check_timeouts();
+        int ret = poll_spin(poll_fds, no_poll_fds, poll_timeout, busy_poll_us * INT64_C(1000));
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syserr("poll");
+        }
+        int64_t loop_start = monotonic_ns();
+
+        // Going from the end, entries moved by removals are already handled.
+        for (size_t i = no_poll_fds; i-- > 0;) {
+            if (i >= no_poll_fds) {
+                continue;
+            }
+            short revents = poll_fds[i].revents;
+            poll_fds[i].revents = 0;
+            if (revents == 0) {
+                continue;
+            }
+
+            int client_fd = poll_fds[i].fd;
+            switch (clients[client_fd].kind) {
+            case CLIENT_LISTENER:
+                accept_clients(client_fd);
+                break;
+            case CLIENT_PENDING:
+            case CLIENT_WAITING:
+                handle_input(client_fd);
+                break;
+            case CLIENT_PLAYER:
+                if (clients[client_fd].table->ready_players == NO_PLAYERS) {
+                    handle_input(client_fd);
+                } else if (revents & (POLLHUP | POLLERR)) {
+                    // The table waits for a player, only the end is noticed.
+                    drop_client(client_fd);
+                }
+                break;
+            case CLIENT_SPECTATOR:
+                handle_spectator(client_fd, revents);
+                break;
+            case CLIENT_HANDOFF:
+                hand_off(client_fd);
+                break;
+            case CLIENT_METRICS:
+                accept_scraper(client_fd);
+                break;
+            case CLIENT_SCRAPER:
+                handle_scraper(client_fd);
+                break;
+            default:
+                break;
+            }
+        }
+        handle_buffered_input();
+        COUNT(COUNTER_LOOP_ITERATIONS, 1);
+        COUNT(COUNTER_LOOP_NS, monotonic_ns() - loop_start);
+
+        // What was received in this iteration goes to the file at once.
+        if (recording != NULL) {
+            fflush(recording);
+        }
+    }
+
+    // Close everything except the spectators who still wait for the scores.
+    for (size_t i = no_poll_fds; i-- > 0;) {
+        if (clients[poll_fds[i].fd].kind != CLIENT_SPECTATOR) {
+            remove_client(poll_fds[i].fd);
+        } else if (clients[poll_fds[i].fd].parked) {
+            remove_spectator(poll_fds[i].fd);
+        }
+    }
+    while (no_poll_fds > 0 && poll(poll_fds, no_poll_fds, timeout * 1000) > 0) {
+        for (size_t i = no_poll_fds; i-- > 0;) {
+            if (i < no_poll_fds && poll_fds[i].revents != 0) {
+                short revents = poll_fds[i].revents;
+                poll_fds[i].revents = 0;
+                handle_spectator(poll_fds[i].fd, revents);
+            }
+        }
+    }
+    while (no_poll_fds > 0) {
+        remove_client(poll_fds[no_poll_fds - 1].fd);
+    }
+
+    print_open_latencies();
+    if (recording != NULL) {
+        fclose(recording);
     }
 
-    
+    if (handoff_path != NULL) {
+        unlink(handoff_path);
+    }
+    if (metrics_address != NULL && strchr(metrics_address, '/') != NULL) {
+        unlink(metrics_address);
+    }
+    if (unix_path != NULL) {
+        unlink(unix_path);
+    }
+    if (journal_opened) {
+        journal_close(&journal);
+    }
+    for (int i = 0; game_desc != NULL && i < no_of_games * NO_PLAYERS; i++) {
+        msgbuf_unref(deal_msgs[i]);
+    }
+    free(deal_msgs);
+    free(parked_fds);
+    free(poll_fds);
+    free(clients);
     free(game_desc);
-}
\ No newline at end of file
+}
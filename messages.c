@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "messages.h"
+
+// Function to write the "DEAL" message for the place (from 1 to 4) to msg.
+// Returns its length.
+size_t format_deal(char *msg, game_desc_t const *game, int place_id) {
+    size_t len = 0;
+    memcpy(msg, "DEAL", strlen("DEAL"));
+    len += strlen("DEAL");
+    msg[len++] = game->game_type;
+    msg[len++] = game->starting_player;
+    for (int i = 0; i < NO_CARDS; i++) {
+        len += put_card(msg + len, game->cards[place_id - 1][i]);
+    }
+    memcpy(msg + len, "\r\n", strlen("\r\n") + 1);
+    return len + strlen("\r\n");
+}
+
+// Function to create the "TRICK" message with the cards laid so far. The
+// message is allocated, the caller frees it.
+char *format_trick(int trick_num, card_t const *cards) {
+    char *msg = malloc(BUF_SIZE * sizeof(char));
+    if (msg == NULL) {
+        syserr("malloc");
+    }
+    memset(msg, 0, BUF_SIZE * sizeof(char));
+    strcat(msg, "TRICK");
+    char num[15];
+    sprintf(num, "%d", trick_num);
+    strcat(msg, num);
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        if (cards[i].num != 0) {
+            msg[strlen(msg)] = cards[i].num;
+            if (cards[i].num == '1') {
+                msg[strlen(msg)] = '0';
+            }
+            msg[strlen(msg)] = cards[i].col;
+        }
+    }
+    strcat(msg, "\r\n");
+    return msg;
+}
+
+// Function to create the "TAKEN" message. The message is allocated, the
+// caller frees it.
+char *format_taken(int trick_num, card_t const *cards, char taker) {
+    char *msg = malloc(BUF_SIZE * sizeof(char));
+    if (msg == NULL) {
+        syserr("malloc");
+    }
+    memset(msg, 0, BUF_SIZE * sizeof(char));
+    strcat(msg, "TAKEN");
+    char num[15];
+    sprintf(num, "%d", trick_num);
+    strcat(msg, num);
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        msg[strlen(msg)] = cards[i].num;
+        if (cards[i].num == '1') {
+            msg[strlen(msg)] = '0';
+        }
+        msg[strlen(msg)] = cards[i].col;
+    }
+    msg[strlen(msg)] = taker;
+    strcat(msg, "\r\n");
+    return msg;
+}
+
+// Function to write the "WRONG" message to msg.
+void format_wrong(char *msg, int trick_num) {
+    sprintf(msg, "WRONG%d\r\n", trick_num);
+}
+
+// Function to write the "SCORE" or "TOTAL" message to msg.
+void format_points(char *msg, char const *type, int const *points) {
+    sprintf(msg, "%sN%dE%dS%dW%d\r\n", type, points[0], points[1], points[2], points[3]);
+}
+
+// Function to parse a "TRICK" message from a player. Returns the number of
+// the trick and stores the card.
+int parse_trick_msg(char const *msg, card_t *card) {
+    int ptr = strlen(msg) - 1 - strlen("\r\n");
+    card->col = msg[ptr--];
+    card->num = msg[ptr--];
+    if (card->num == '0' && msg[ptr] == '1') {
+        card->num = msg[ptr--];
+    }
+    int trick_num = 0;
+    for (int i = strlen("TRICK"); i <= ptr; i++) {
+        trick_num = trick_num * 10 + (msg[i] - '0');
+    }
+    return trick_num;
+}
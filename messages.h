@@ -0,0 +1,14 @@
+#ifndef MIM_MESSAGES_H
+#define MIM_MESSAGES_H
+
+#include "common.h"
+#include "deal.h"
+
+size_t format_deal(char *msg, game_desc_t const *game, int place_id);
+char *format_trick(int trick_num, card_t const *cards);
+char *format_taken(int trick_num, card_t const *cards, char taker);
+void format_wrong(char *msg, int trick_num);
+void format_points(char *msg, char const *type, int const *points);
+int parse_trick_msg(char const *msg, card_t *card);
+
+#endif
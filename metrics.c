@@ -0,0 +1,113 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "metrics.h"
+
+_Thread_local metrics_t *thread_metrics = NULL;
+
+// Counters of all the threads, they are kept after the thread ends.
+static metrics_t *all_metrics = NULL;
+static pthread_mutex_t all_metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char const *type_names[NO_MSG_TYPES] = {
+    "IAM", "BUSY", "DEAL", "TRICK", "WRONG", "TAKEN", "SCORE", "TOTAL", "WATCH", "OTHER",
+};
+
+static struct {
+    char const *name;
+    char const *help;
+} const counter_descs[NO_COUNTERS] = {
+    {"kierki_connections_accepted_total", "Connections accepted."},
+    {"kierki_connections_turned_away_total", "Connections closed for lack of descriptors."},
+    {"kierki_deals_completed_total", "Deals played to the end."},
+    {"kierki_games_completed_total", "Tables which played all the deals."},
+    {"kierki_pending_timeouts_total", "Clients dropped for not introducing themselves."},
+    {"kierki_player_timeouts_total", "Players who didn't answer TRICK in time."},
+    {"kierki_retransmits_total", "TRICK messages sent again."},
+    {"kierki_repeated_tricks_total", "TRICK messages from players repeating a played card."},
+    {"kierki_throttled_total", "Messages dropped for exceeding the rate limit."},
+    {"kierki_coalesced_wrongs_total", "WRONG messages not sent, as one was just sent."},
+    {"kierki_flood_disconnects_total", "Clients dropped for too many unwanted messages."},
+    {"kierki_loop_iterations_total", "Iterations of the main loop."},
+    {"kierki_loop_seconds_total", "Time spent handling events in the main loop."},
+    {"kierki_journal_syncs_total", "Batches of journal records synced to the disk."},
+    {"kierki_journal_bytes_total", "Bytes written to the journal."},
+};
+
+// Function to create the counters of the calling thread.
+metrics_t *metrics_register(void) {
+    metrics_t *metrics = calloc(1, sizeof(metrics_t));
+    if (metrics == NULL) {
+        syserr("calloc");
+    }
+    pthread_mutex_lock(&all_metrics_mutex);
+    metrics->next = all_metrics;
+    all_metrics = metrics;
+    pthread_mutex_unlock(&all_metrics_mutex);
+    thread_metrics = metrics;
+    return metrics;
+}
+
+// Function to get the type of the message from its first letters.
+msg_type_t msg_type(char const *msg) {
+    switch (msg[0]) {
+    case 'I':
+        return TYPE_IAM;
+    case 'B':
+        return TYPE_BUSY;
+    case 'D':
+        return TYPE_DEAL;
+    case 'S':
+        return TYPE_SCORE;
+    case 'T':
+        return msg[1] == 'R' ? TYPE_TRICK : msg[1] == 'A' ? TYPE_TAKEN : TYPE_TOTAL;
+    case 'W':
+        return msg[1] == 'R' ? TYPE_WRONG : TYPE_WATCH;
+    default:
+        return TYPE_OTHER;
+    }
+}
+
+// Function to write the sums of the counters of all the threads in the
+// Prometheus text format.
+void metrics_write(FILE *file) {
+    metrics_t sum;
+    memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&all_metrics_mutex);
+    for (metrics_t *metrics = all_metrics; metrics != NULL; metrics = metrics->next) {
+        for (int i = 0; i < NO_COUNTERS; i++) {
+            sum.counters[i] += __atomic_load_n(&metrics->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < NO_MSG_TYPES; i++) {
+            sum.msgs_in[i] += __atomic_load_n(&metrics->msgs_in[i], __ATOMIC_RELAXED);
+            sum.msgs_out[i] += __atomic_load_n(&metrics->msgs_out[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&all_metrics_mutex);
+
+    for (int i = 0; i < NO_COUNTERS; i++) {
+        fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", counter_descs[i].name,
+            counter_descs[i].help, counter_descs[i].name);
+        if (i == COUNTER_LOOP_NS) {
+            fprintf(file, "%s %.9f\n", counter_descs[i].name, (double) sum.counters[i] / 1e9);
+        } else {
+            fprintf(file, "%s %" PRIu64 "\n", counter_descs[i].name, sum.counters[i]);
+        }
+    }
+
+    fprintf(file, "# HELP kierki_messages_received_total Messages received by type.\n"
+        "# TYPE kierki_messages_received_total counter\n");
+    for (int i = 0; i < NO_MSG_TYPES; i++) {
+        fprintf(file, "kierki_messages_received_total{type=\"%s\"} %" PRIu64 "\n",
+            type_names[i], sum.msgs_in[i]);
+    }
+    fprintf(file, "# HELP kierki_messages_sent_total Messages sent by type.\n"
+        "# TYPE kierki_messages_sent_total counter\n");
+    for (int i = 0; i < NO_MSG_TYPES; i++) {
+        fprintf(file, "kierki_messages_sent_total{type=\"%s\"} %" PRIu64 "\n",
+            type_names[i], sum.msgs_out[i]);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef MIM_METRICS_H
+#define MIM_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Types of protocol messages counted separately.
+typedef enum msg_type_t {
+    TYPE_IAM,
+    TYPE_BUSY,
+    TYPE_DEAL,
+    TYPE_TRICK,
+    TYPE_WRONG,
+    TYPE_TAKEN,
+    TYPE_SCORE,
+    TYPE_TOTAL,
+    TYPE_WATCH,
+    TYPE_OTHER,
+    NO_MSG_TYPES,
+} msg_type_t;
+
+// Counters without labels.
+typedef enum counter_t {
+    COUNTER_ACCEPTED,
+    COUNTER_TURNED_AWAY,
+    COUNTER_DEALS,
+    COUNTER_GAMES,
+    COUNTER_PENDING_TIMEOUTS,
+    COUNTER_PLAYER_TIMEOUTS,
+    COUNTER_RETRANSMITS,
+    COUNTER_REPEATED_TRICKS,
+    COUNTER_THROTTLED,
+    COUNTER_COALESCED_WRONGS,
+    COUNTER_FLOOD_DISCONNECTS,
+    COUNTER_LOOP_ITERATIONS,
+    COUNTER_LOOP_NS,
+    COUNTER_JOURNAL_SYNCS,
+    COUNTER_JOURNAL_BYTES,
+    NO_COUNTERS,
+} counter_t;
+
+// Counters of one thread. Only the owner writes them, so incrementing is an
+// ordinary addition. Other threads only read them when the metrics are
+// scraped.
+typedef struct metrics_t {
+    uint64_t counters[NO_COUNTERS];
+    uint64_t msgs_in[NO_MSG_TYPES];
+    uint64_t msgs_out[NO_MSG_TYPES];
+    struct metrics_t *next;
+} metrics_t;
+
+extern _Thread_local metrics_t *thread_metrics;
+
+metrics_t *metrics_register(void);
+msg_type_t msg_type(char const *msg);
+void metrics_write(FILE *file);
+
+// Function to get the counters of the calling thread.
+static inline metrics_t *metrics_local(void) {
+    return thread_metrics != NULL ? thread_metrics : metrics_register();
+}
+
+// Function to increase a counter of the calling thread. The store is atomic
+// only so that a concurrent scrape never sees a torn value.
+static inline void metrics_add(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+#define COUNT(counter, value) metrics_add(&metrics_local()->counters[counter], value)
+#define COUNT_IN(type) metrics_add(&metrics_local()->msgs_in[type], 1)
+#define COUNT_OUT(type, value) metrics_add(&metrics_local()->msgs_out[type], value)
+
+#endif
@@ -0,0 +1,118 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "err.h"
+#include "msgbuf.h"
+
+#define MAX_IOV 64
+
+msgbuf_t *msgbuf_new(char const *data, size_t len) {
+    msgbuf_t *buf = malloc(sizeof(msgbuf_t) + len + 1);
+    if (buf == NULL) {
+        syserr("malloc");
+    }
+    buf->refs = 1;
+    buf->len = len;
+    memcpy(buf->data, data, len);
+    buf->data[len] = '\0';
+    return buf;
+}
+
+msgbuf_t *msgbuf_ref(msgbuf_t *buf) {
+    buf->refs++;
+    return buf;
+}
+
+void msgbuf_unref(msgbuf_t *buf) {
+    if (buf != NULL && --buf->refs == 0) {
+        free(buf);
+    }
+}
+
+void msg_queue_init(msg_queue_t *queue) {
+    memset(queue, 0, sizeof(msg_queue_t));
+}
+
+void msg_queue_free(msg_queue_t *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        msgbuf_unref(queue->bufs[(queue->head + i) % queue->capacity]);
+    }
+    free(queue->bufs);
+    msg_queue_init(queue);
+}
+
+// Function to add a reference to the message at the end of the queue.
+void msg_queue_push(msg_queue_t *queue, msgbuf_t *buf) {
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity == 0 ? 8 : 2 * queue->capacity;
+        msgbuf_t **bufs = malloc(capacity * sizeof(msgbuf_t *));
+        if (bufs == NULL) {
+            syserr("malloc");
+        }
+        for (size_t i = 0; i < queue->count; i++) {
+            bufs[i] = queue->bufs[(queue->head + i) % queue->capacity];
+        }
+        free(queue->bufs);
+        queue->bufs = bufs;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+    queue->bufs[(queue->head + queue->count) % queue->capacity] = msgbuf_ref(buf);
+    queue->count++;
+}
+
+// Writes as much of the queue as the socket accepts without blocking.
+// Returns the number of bytes written, or -1 if the connection is broken.
+ssize_t msg_queue_flush(msg_queue_t *queue, int fd) {
+    ssize_t total = 0;
+    while (queue->count > 0) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        while ((size_t) iovcnt < queue->count && iovcnt < MAX_IOV) {
+            msgbuf_t *buf = queue->bufs[(queue->head + iovcnt) % queue->capacity];
+            size_t skip = iovcnt == 0 ? queue->offset : 0;
+            iov[iovcnt].iov_base = buf->data + skip;
+            iov[iovcnt].iov_len = buf->len - skip;
+            iovcnt++;
+        }
+
+        // sendmsg() instead of writev(), so a closed peer doesn't raise SIGPIPE.
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t written = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+
+        // Drop the messages written completely.
+        size_t left = (size_t) written;
+        while (queue->count > 0) {
+            msgbuf_t *buf = queue->bufs[queue->head];
+            size_t remaining = buf->len - queue->offset;
+            if (left < remaining) {
+                queue->offset += left;
+                break;
+            }
+            left -= remaining;
+            msgbuf_unref(buf);
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->count--;
+            queue->offset = 0;
+        }
+        if (written == 0) {
+            break;
+        }
+    }
+    return total;
+}
@@ -0,0 +1,34 @@
+#ifndef MIM_MSGBUF_H
+#define MIM_MSGBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Serialized message shared by many connections. The contents never change
+// after creation, the buffer is freed when the last reference is dropped.
+typedef struct msgbuf_t {
+    size_t refs;
+    size_t len;
+    char data[];
+} msgbuf_t;
+
+// Queue of messages waiting to be written to a non-blocking socket.
+typedef struct msg_queue_t {
+    msgbuf_t **bufs;
+    size_t head;      // Index of the oldest message.
+    size_t count;
+    size_t capacity;
+    size_t offset;    // Bytes of the oldest message already written.
+} msg_queue_t;
+
+msgbuf_t *msgbuf_new(char const *data, size_t len);
+msgbuf_t *msgbuf_ref(msgbuf_t *buf);
+void msgbuf_unref(msgbuf_t *buf);
+
+void msg_queue_init(msg_queue_t *queue);
+void msg_queue_free(msg_queue_t *queue);
+void msg_queue_push(msg_queue_t *queue, msgbuf_t *buf);
+ssize_t msg_queue_flush(msg_queue_t *queue, int fd);
+
+#endif
@@ -0,0 +1,400 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "player.h"
+#include "compact.h"
+#include "rules.h"
+#include "strategy.h"
+#include "probes.h"
+
+// Reacts to a message in the current state. Returns length of the reply
+// written to out, 0 if there is nothing to send and -1 if the connection
+// should be closed.
+typedef ssize_t (*transition_fn)(player_t *player, char const *msg, char *out);
+
+void player_init(player_t *player, int fd, char seat, strategy_t const *strategy) {
+    memset(player, 0, sizeof(player_t));
+    player->fd = fd;
+    player->seat = seat;
+    player->strategy = strategy;
+    player->rng = (uint64_t) fd * 4 + (uint64_t) (strchr("NESW*", seat) - "NESW*");
+    player->state = PLAYER_IDLE;
+    frame_init(&player->in);
+}
+
+// Writes the IAM message for the player's seat, asking for the compact form
+// if the player uses it. Returns its length.
+size_t player_iam(player_t const *player, char *out) {
+    if (player->compact) {
+        return sprintf(out, "IAM%c%c\r\n", player->seat, COMPACT_SUFFIX);
+    }
+    return sprintf(out, "IAM%c\r\n", player->seat);
+}
+
+msg_type_t player_msg_type(char const *msg) {
+    static char const *const prefixes[] = {
+        [MSG_IAM] = "IAM",
+        [MSG_BUSY] = "BUSY",
+        [MSG_DEAL] = "DEAL",
+        [MSG_TRICK] = "TRICK",
+        [MSG_WRONG] = "WRONG",
+        [MSG_TAKEN] = "TAKEN",
+        [MSG_SCORE] = "SCORE",
+        [MSG_TOTAL] = "TOTAL",
+    };
+    for (int type = 0; type < MSG_UNKNOWN; type++) {
+        if (strncmp(msg, prefixes[type], strlen(prefixes[type])) == 0) {
+            return type;
+        }
+    }
+    return MSG_UNKNOWN;
+}
+
+// Parses "<trick number><cards>[<place>]\r\n". As cards may start with a digit
+// too, both one and two digit numbers are tried; only one of them can leave
+// valid cards behind. Returns false if the message is malformed.
+static bool parse_numbered(char const *str, bool with_place, int *trick_num,
+                           card_t *cards, int *count) {
+    for (int digits = 1; digits <= 2; digits++) {
+        if (str[digits - 1] < '0' || str[digits - 1] > '9') {
+            return false;
+        }
+        int num = str[0] - '0';
+        if (digits == 2) {
+            num = num * 10 + str[1] - '0';
+        }
+        if (num < 1 || num > NO_CARDS) {
+            continue;
+        }
+
+        size_t ptr = digits;
+        size_t card_len;
+        *count = 0;
+        while (*count < NO_PLAYERS && (card_len = parse_card(str + ptr, &cards[*count])) > 0) {
+            ptr += card_len;
+            (*count)++;
+        }
+        if (with_place && str[ptr] != '\0' && strchr("NESW", str[ptr]) != NULL) {
+            ptr++;
+        } else if (with_place) {
+            continue;
+        }
+        if (strcmp(str + ptr, "\r\n") == 0) {
+            *trick_num = num;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Parses "N<points>E<points>S<points>W<points>\r\n".
+static bool parse_points(char const *str, int *points) {
+    size_t ptr = 0;
+    for (int i = 0; i < NO_PLAYERS; i++) {
+        if (str[ptr++] != "NESW"[i] || str[ptr] < '0' || str[ptr] > '9') {
+            return false;
+        }
+        points[i] = 0;
+        while (str[ptr] >= '0' && str[ptr] <= '9') {
+            points[i] = points[i] * 10 + str[ptr++] - '0';
+        }
+    }
+    return strcmp(str + ptr, "\r\n") == 0;
+}
+
+// Function to check if the card was already answered with WRONG.
+static bool is_rejected(player_t const *player, card_t card) {
+    for (int i = 0; i < player->rejected_count; i++) {
+        if (player->rejected[i].num == card.num && player->rejected[i].col == card.col) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Picks a card with the player's strategy and plays it.
+static ssize_t decide(player_t *player, char *out) {
+    if (player->strategy == NULL) {
+        return 0; // The user will pick the card.
+    }
+
+    // Cards rejected by the server are not considered again.
+    card_t hand[NO_CARDS];
+    for (int i = 0; i < NO_CARDS; i++) {
+        hand[i] = player->cards[i];
+        if (is_rejected(player, hand[i])) {
+            hand[i].num = 0;
+            hand[i].col = 0;
+        }
+    }
+
+    int card_id = player->strategy->pick(hand, player->laid, player->laid_count,
+        &player->rng);
+    if (!is_legal_card(hand, card_id, player->laid, player->laid_count)) {
+        // Fall back to any legal card or, if the server disagrees with us
+        // about what is legal, to any card not tried yet.
+        card_id = -1;
+        for (int i = 0; i < NO_CARDS && card_id == -1; i++) {
+            if (is_legal_card(hand, i, player->laid, player->laid_count)) {
+                card_id = i;
+            }
+        }
+        for (int i = 0; i < NO_CARDS && card_id == -1; i++) {
+            if (hand[i].num != 0) {
+                card_id = i;
+            }
+        }
+        if (card_id == -1) {
+            return 0;
+        }
+    }
+    return player_play(player, hand[card_id], out);
+}
+
+// Writes the TRICK message with the card. Returns its length.
+size_t player_play(player_t *player, card_t card, char *out) {
+    size_t len = sprintf(out, "TRICK%d", player->trick_num);
+    len += put_card(out + len, card);
+    len += sprintf(out + len, "\r\n");
+
+    player->played = card;
+    if (player->state == PLAYER_TRICK) {
+        player->state = PLAYER_TAKEN;
+    }
+    return len;
+}
+
+// The server picked a seat for the player who asked for any.
+static ssize_t on_iam(player_t *player, char const *msg, char *out) {
+    (void) out;
+    if (player->seat == '*' && strchr("NESW", msg[3]) != NULL && msg[3] != '\0' &&
+        strcmp(msg + 4, "\r\n") == 0) {
+        player->seat = msg[3];
+    }
+    return 0;
+}
+
+static ssize_t on_busy(player_t *player, char const *msg, char *out) {
+    (void) out;
+    size_t len = strlen(msg) - strlen("BUSY") - strlen("\r\n");
+    if (len > NO_PLAYERS) {
+        len = NO_PLAYERS;
+    }
+    memcpy(player->busy, msg + strlen("BUSY"), len);
+    player->busy[len] = '\0';
+    return -1;
+}
+
+// New deal, also sent again after reconnecting in the middle of it.
+static ssize_t on_deal(player_t *player, char const *msg, char *out) {
+    (void) out;
+    card_t cards[NO_CARDS];
+    memset(cards, 0, sizeof(cards));
+    size_t ptr = strlen("DEAL") + 2;
+    int count = 0;
+    size_t card_len;
+    while (count < NO_CARDS && (card_len = parse_card(msg + ptr, &cards[count])) > 0) {
+        ptr += card_len;
+        count++;
+    }
+    if (count == 0 || strcmp(msg + ptr, "\r\n") != 0) {
+        return 0;
+    }
+
+    // After reconnecting the server repeats the DEAL, possibly without the
+    // cards played already, and the TAKEN messages of the tricks taken. The
+    // server may be behind what we saw, if it lost its last moves in a crash,
+    // so we go back to the trick after the cards missing from the DEAL. The
+    // missed TAKEN messages bring us to the server's trick.
+    bool resumed = player->resuming && player->state != PLAYER_IDLE &&
+        player->game_type == msg[4] && player->starting_player == msg[5];
+    for (int i = 0; i < count && resumed; i++) {
+        bool dealt = false;
+        for (int j = 0; j < NO_CARDS; j++) {
+            if (player->dealt[j].num == cards[i].num && player->dealt[j].col == cards[i].col) {
+                dealt = true;
+            }
+        }
+        resumed = dealt;
+    }
+    player->resuming = false;
+    if (resumed) {
+        memcpy(player->cards, cards, sizeof(cards));
+        player->trick_num = NO_CARDS - count + 1;
+        for (int i = player->trick_num - 1; i < NO_CARDS; i++) {
+            memset(player->tricks[i], 0, sizeof(player->tricks[i]));
+            player->taken_by[i] = 0;
+        }
+        player->laid_count = 0;
+        player->played.num = 0;
+        player->played.col = 0;
+        player->rejected_count = 0;
+        player->state = PLAYER_TRICK;
+        return 0;
+    }
+
+    player->game_type = msg[4];
+    player->starting_player = msg[5];
+    memcpy(player->dealt, cards, sizeof(cards));
+    memcpy(player->cards, cards, sizeof(cards));
+    memset(player->tricks, 0, sizeof(player->tricks));
+    memset(player->taken_by, 0, sizeof(player->taken_by));
+    player->trick_num = 1;
+    player->laid_count = 0;
+    player->played.num = 0;
+    player->played.col = 0;
+    player->rejected_count = 0;
+    player->state = PLAYER_TRICK;
+    PROBE2(deal_start, player->fd, player->game_type);
+    return 0;
+}
+
+static ssize_t on_trick(player_t *player, char const *msg, char *out) {
+    int trick_num, count;
+    card_t laid[NO_PLAYERS];
+    if (!parse_numbered(msg + strlen("TRICK"), false, &trick_num, laid, &count) ||
+        trick_num != player->trick_num || count >= NO_PLAYERS) {
+        return 0;
+    }
+    memcpy(player->laid, laid, count * sizeof(card_t));
+    player->laid_count = count;
+    return decide(player, out);
+}
+
+// TRICK repeated by the server while our card is on the way. The server
+// answers the card anyway, so it is not sent again.
+static ssize_t on_repeated_trick(player_t *player, char const *msg, char *out) {
+    (void) player;
+    (void) msg;
+    (void) out;
+    return 0;
+}
+
+static ssize_t on_wrong(player_t *player, char const *msg, char *out) {
+    (void) msg;
+    if (player->state != PLAYER_TAKEN) {
+        return 0; // Card played by the user out of turn.
+    }
+    if (player->rejected_count < NO_CARDS) {
+        player->rejected[player->rejected_count++] = player->played;
+    }
+    player->played.num = 0;
+    player->played.col = 0;
+    player->state = PLAYER_TRICK;
+    return decide(player, out);
+}
+
+static ssize_t on_taken(player_t *player, char const *msg, char *out) {
+    (void) out;
+    int trick_num, count;
+    card_t trick[NO_PLAYERS];
+    if (!parse_numbered(msg + strlen("TAKEN"), true, &trick_num, trick, &count) ||
+        trick_num != player->trick_num || count != NO_PLAYERS) {
+        return 0; // Repeated or malformed TAKEN.
+    }
+
+    // Remove our card from the hand.
+    for (int i = 0; i < NO_CARDS; i++) {
+        for (int j = 0; j < NO_PLAYERS; j++) {
+            if (player->cards[i].num == trick[j].num && player->cards[i].col == trick[j].col) {
+                player->cards[i].num = 0;
+                player->cards[i].col = 0;
+            }
+        }
+    }
+    memcpy(player->tricks[trick_num - 1], trick, sizeof(trick));
+    player->taken_by[trick_num - 1] = msg[strlen(msg) - 1 - strlen("\r\n")];
+    PROBE3(trick_resolve, player->fd, trick_num, player->taken_by[trick_num - 1]);
+
+    player->trick_num++;
+    player->laid_count = 0;
+    player->played.num = 0;
+    player->played.col = 0;
+    player->rejected_count = 0;
+    player->state = player->trick_num > NO_CARDS ? PLAYER_SCORE : PLAYER_TRICK;
+    return 0;
+}
+
+static ssize_t on_score(player_t *player, char const *msg, char *out) {
+    (void) out;
+    if (parse_points(msg + strlen("SCORE"), player->scores)) {
+        player->state = PLAYER_TOTAL;
+        PROBE2(deal_end, player->fd, player->game_type);
+    }
+    return 0;
+}
+
+static ssize_t on_total(player_t *player, char const *msg, char *out) {
+    (void) out;
+    if (parse_points(msg + strlen("TOTAL"), player->totals)) {
+        player->state = PLAYER_IDLE;
+    }
+    return 0;
+}
+
+// Prepares the player for a new connection to the server in the middle of
+// the game. The card sent before the connection broke might not have reached
+// the server, so the player waits for TRICK again.
+void player_reconnected(player_t *player, int fd) {
+    player->fd = fd;
+    frame_init(&player->in);
+    player->in.compact = player->compact;
+    if (player->state == PLAYER_TAKEN) {
+        player->played.num = 0;
+        player->played.col = 0;
+        player->state = PLAYER_TRICK;
+    }
+    player->resuming = true;
+}
+
+// Switches the player to the compact form, before introducing himself.
+void player_use_compact(player_t *player) {
+    player->compact = true;
+    player->in.compact = true;
+}
+
+// Reactions to messages in every state; NULL means the message is ignored.
+static transition_fn const transitions[NO_PLAYER_STATES][NO_MSG_TYPES] = {
+    [PLAYER_IDLE] = {
+        [MSG_IAM] = on_iam,
+        [MSG_BUSY] = on_busy,
+        [MSG_DEAL] = on_deal,
+    },
+    [PLAYER_TRICK] = {
+        [MSG_BUSY] = on_busy,
+        [MSG_DEAL] = on_deal,
+        [MSG_TRICK] = on_trick,
+        [MSG_WRONG] = on_wrong,
+        [MSG_TAKEN] = on_taken,
+    },
+    [PLAYER_TAKEN] = {
+        [MSG_BUSY] = on_busy,
+        [MSG_DEAL] = on_deal,
+        [MSG_TRICK] = on_repeated_trick,
+        [MSG_WRONG] = on_wrong,
+        [MSG_TAKEN] = on_taken,
+    },
+    [PLAYER_SCORE] = {
+        [MSG_BUSY] = on_busy,
+        [MSG_DEAL] = on_deal,
+        [MSG_SCORE] = on_score,
+    },
+    [PLAYER_TOTAL] = {
+        [MSG_BUSY] = on_busy,
+        [MSG_DEAL] = on_deal,
+        [MSG_TOTAL] = on_total,
+    },
+};
+
+// Processes one "\r\n" terminated message from the server. The reply to be
+// sent (if any) is written to out. Returns length of the reply, 0 if there
+// is nothing to send and -1 if the connection should be closed.
+ssize_t player_handle_msg(player_t *player, char const *msg, char *out) {
+    transition_fn transition = transitions[player->state][player_msg_type(msg)];
+    if (transition == NULL) {
+        return 0;
+    }
+    return transition(player, msg, out);
+}
@@ -0,0 +1,73 @@
+#ifndef MIM_PLAYER_H
+#define MIM_PLAYER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "strategy.h"
+
+// States of the client side of the protocol.
+typedef enum player_state_t {
+    PLAYER_IDLE,   // Waiting for DEAL.
+    PLAYER_TRICK,  // Waiting for TRICK (or the user's card in manual mode).
+    PLAYER_TAKEN,  // Card sent, waiting for TAKEN or WRONG.
+    PLAYER_SCORE,  // All tricks taken, waiting for SCORE.
+    PLAYER_TOTAL,  // Waiting for TOTAL.
+    NO_PLAYER_STATES,
+} player_state_t;
+
+// Types of messages sent by the server.
+typedef enum msg_type_t {
+    MSG_IAM,
+    MSG_BUSY,
+    MSG_DEAL,
+    MSG_TRICK,
+    MSG_WRONG,
+    MSG_TAKEN,
+    MSG_SCORE,
+    MSG_TOTAL,
+    MSG_UNKNOWN,
+    NO_MSG_TYPES,
+} msg_type_t;
+
+// Struct to store state of one player's connection.
+typedef struct player_t {
+    int fd;
+    char seat;                  // '*' until the server picks one.
+    strategy_t const *strategy; // NULL if cards are picked by the user.
+    uint64_t rng;
+    player_state_t state;
+
+    // Game data.
+    char game_type;
+    char starting_player;
+    card_t dealt[NO_CARDS];              // Cards from DEAL.
+    card_t cards[NO_CARDS];              // Cards left in hand.
+    int trick_num;                       // Trick being played, from 1.
+    card_t laid[NO_PLAYERS - 1];         // Cards from the last TRICK.
+    int laid_count;
+    card_t played;                       // Card sent in the current trick.
+    card_t rejected[NO_CARDS];           // Cards answered with WRONG in it.
+    int rejected_count;
+    card_t tricks[NO_CARDS][NO_PLAYERS]; // Tricks taken so far.
+    char taken_by[NO_CARDS];
+    char busy[NO_PLAYERS + 1];           // Places from BUSY.
+    int scores[NO_PLAYERS];
+    int totals[NO_PLAYERS];
+    bool resuming;                       // Connected again during the deal.
+    bool compact;                        // Talks in the compact binary form.
+
+    frame_buf_t in;
+} player_t;
+
+void player_init(player_t *player, int fd, char seat, strategy_t const *strategy);
+size_t player_iam(player_t const *player, char *out);
+msg_type_t player_msg_type(char const *msg);
+ssize_t player_handle_msg(player_t *player, char const *msg, char *out);
+size_t player_play(player_t *player, card_t card, char *out);
+void player_reconnected(player_t *player, int fd);
+void player_use_compact(player_t *player);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef MIM_PROBES_H
+#define MIM_PROBES_H
+
+// Static tracepoints of the "kierki" provider. With <sys/sdt.h> available a
+// probe is a single nop and a note in the binary, so bpftrace or perf can
+// attach to it without rebuilding, e.g.
+//   bpftrace -e 'usdt:./kierki-serwer:kierki:msg_recv { printf("%s", str(arg1)); }'
+// Without it the probes compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT_PROBES
+#endif
+#endif
+
+#ifdef HAVE_SDT_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(kierki, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(kierki, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(kierki, name, a, b, c)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE // For memfd_create().
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "common.h"
+#include "ring.h"
+
+// Function to map the segment passed as memfd. The server reads what the
+// client writes to to_server and the other way round.
+bool ring_map(ring_t *ring, int memfd, int socket_fd, bool server_side) {
+    void *shared = mmap(NULL, sizeof(ring_shared_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shared == MAP_FAILED) {
+        return false;
+    }
+    ring->shared = shared;
+    ring->in = server_side ? &ring->shared->to_server : &ring->shared->to_client;
+    ring->out = server_side ? &ring->shared->to_client : &ring->shared->to_server;
+    ring->memfd = memfd;
+    ring->socket_fd = socket_fd;
+
+    // Nothing was read yet, so any data needs a wakeup.
+    atomic_store(&ring->in->sleeping, RING_ASLEEP);
+    return true;
+}
+
+// Function to create the segment for the client connected to the Unix socket
+// and map it on the server side. Returns the descriptor of the segment to be
+// passed to the client, -1 on failure.
+int ring_create(ring_t *ring, int socket_fd) {
+    // Descriptors can't be passed over other sockets.
+    int domain;
+    socklen_t domain_len = sizeof(domain);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) < 0 ||
+        domain != AF_UNIX) {
+        return -1;
+    }
+
+    int memfd = memfd_create("kierki-ring", MFD_CLOEXEC);
+    if (memfd < 0) {
+        return -1;
+    }
+    if (ftruncate(memfd, sizeof(ring_shared_t)) < 0 || !ring_map(ring, memfd, socket_fd, true)) {
+        close(memfd);
+        return -1;
+    }
+    return memfd;
+}
+
+// Function to receive the segment sent by the server after IAM and map it on
+// the client side. Returns false if the server didn't send it.
+bool ring_join(ring_t *ring, int socket_fd) {
+    char reply;
+    int memfd;
+    if (recv_with_fd(socket_fd, &reply, 1, &memfd) != 1 || memfd == -1) {
+        return false;
+    }
+    if (reply != RING_SUFFIX || !ring_map(ring, memfd, socket_fd, false)) {
+        close(memfd);
+        return false;
+    }
+    return true;
+}
+
+// Function to unmap the segment, the socket stays open.
+void ring_free(ring_t *ring) {
+    if (ring->shared != NULL) {
+        munmap(ring->shared, sizeof(ring_shared_t));
+        close(ring->memfd);
+        ring->shared = NULL;
+    }
+}
+
+// Function to write all the data or nothing, if there is no room for it.
+// The reader is woken up only if it went to sleep.
+bool ring_writev(ring_t *ring, struct iovec const *iov, int iovcnt) {
+    ring_half_t *out = ring->out;
+    uint32_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&out->head, memory_order_acquire);
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total > RING_SIZE - (uint32_t) (tail - head)) {
+        return false;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        char const *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        size_t pos = tail % RING_SIZE;
+        size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+        memcpy(out->data + pos, data, first);
+        memcpy(out->data, data + first, len - first);
+        tail += (uint32_t) len;
+    }
+    atomic_store_explicit(&out->tail, tail, memory_order_release);
+
+    // Pairs with the fence in ring_arm(): either the reader sees the new
+    // tail, or we see that it sleeps.
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t asleep = RING_ASLEEP;
+    if (atomic_load_explicit(&out->sleeping, memory_order_relaxed) == RING_ASLEEP &&
+        atomic_compare_exchange_strong(&out->sleeping, &asleep, 0)) {
+        send(ring->socket_fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return true;
+}
+
+// Function to write one message, like ring_writev().
+bool ring_write(ring_t *ring, void const *data, size_t len) {
+    struct iovec iov = {.iov_base = (void *) data, .iov_len = len};
+    return ring_writev(ring, &iov, 1);
+}
+
+// Function to move what the peer wrote to the buffer. Returns the number of
+// bytes read.
+static size_t ring_take(ring_t *ring, char *data, size_t size) {
+    ring_half_t *in = ring->in;
+    uint32_t head = atomic_load_explicit(&in->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&in->tail, memory_order_acquire);
+    size_t len = (uint32_t) (tail - head);
+    if (len > size) {
+        len = size;
+    }
+
+    size_t pos = head % RING_SIZE;
+    size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+    memcpy(data, in->data + pos, first);
+    memcpy(data + first, in->data, len - first);
+    atomic_store_explicit(&in->head, head + (uint32_t) len, memory_order_release);
+    return len;
+}
+
+// Function to ask the peer for a wakeup before going to sleep on the socket.
+// Returns true if there is data already, then the caller shouldn't sleep.
+static bool ring_arm(ring_t *ring) {
+    atomic_store(&ring->in->sleeping, RING_ASLEEP);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&ring->in->tail, memory_order_acquire) !=
+        atomic_load_explicit(&ring->in->head, memory_order_relaxed);
+}
+
+// Reads whatever the peer wrote into the buffer, like frame_fill(). Unless
+// the buffer gets full, the ring is left empty and the peer will wake us up
+// through the socket when it writes again. The socket is read only to throw
+// the wakeups away: 0 means that the peer closed the connection and -1 with
+// errno EAGAIN that there is nothing yet.
+ssize_t ring_fill(ring_t *ring, frame_buf_t *frame) {
+    size_t space = frame_reserve(frame);
+    char *data = frame->data + frame->end;
+
+    // The flag is cleared by the peer sending a wakeup.
+    bool woken = atomic_load_explicit(&ring->in->sleeping, memory_order_relaxed) == 0;
+    size_t len = ring_take(ring, data, space);
+    ssize_t read_length = 1;
+    int recv_errno = EAGAIN;
+    if (woken || len == 0) {
+        // There is at most one wakeup for every time we go to sleep.
+        char wakeups[64];
+        read_length = recv(ring->socket_fd, wakeups, sizeof(wakeups), MSG_DONTWAIT);
+        recv_errno = errno;
+    }
+
+    // What the peer writes before it sees the flag is taken now.
+    while (len < space && ring_arm(ring)) {
+        len += ring_take(ring, data + len, space - len);
+    }
+    if (len == 0) {
+        bool would_block = recv_errno == EAGAIN || recv_errno == EWOULDBLOCK;
+        if (read_length > 0 || (read_length < 0 && would_block)) {
+            errno = EAGAIN;
+            return -1;
+        }
+        // The end of the connection stays on the socket until the rest of
+        // the data is read.
+        errno = recv_errno;
+        return read_length;
+    }
+    frame->end += len;
+    return (ssize_t) len;
+}
+
+// Function to sleep until the peer writes something or the connection ends.
+// For the first spin_ns nanoseconds the ring is only watched, and the peer
+// doesn't send wakeups meanwhile.
+void ring_wait(ring_t *ring, int64_t spin_ns) {
+    ring_half_t *in = ring->in;
+    uint32_t asleep = RING_ASLEEP;
+    if (spin_ns > 0 && atomic_compare_exchange_strong(&in->sleeping, &asleep, RING_SPINNING)) {
+        int64_t deadline = monotonic_ns() + spin_ns;
+        while (atomic_load_explicit(&in->tail, memory_order_acquire) ==
+               atomic_load_explicit(&in->head, memory_order_relaxed)) {
+            if (monotonic_ns() >= deadline) {
+                break;
+            }
+#if defined(__x86_64__) || defined(__i386__)
+            _mm_pause();
+#endif
+        }
+    }
+    if (!ring_arm(ring)) {
+        struct pollfd fd = {.fd = ring->socket_fd, .events = POLLIN};
+        poll(&fd, 1, -1);
+    }
+}
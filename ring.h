@@ -0,0 +1,57 @@
+#ifndef MIM_RING_H
+#define MIM_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "common.h"
+
+// Shared memory form of a connection over a Unix socket. A client asks for it
+// by putting RING_SUFFIX after the place (and the compact suffix) in IAM, the
+// server answers with a byte and the descriptor of a memory segment holding
+// one ring per direction. From then on the messages go through the rings and
+// the socket only wakes up the reader who went to sleep and shows the end of
+// the connection.
+#define RING_SUFFIX 'M'
+#define RING_SIZE 65536 // Bytes in each direction, a power of two.
+#define CACHE_LINE 64
+#define RING_ASLEEP 1   // The reader waits on the socket.
+#define RING_SPINNING 2 // The reader watches the ring, no wakeup needed.
+
+// One direction of the connection, written by one process and read by the
+// other. Positions only grow, they are taken modulo RING_SIZE.
+typedef struct ring_half_t {
+    _Alignas(CACHE_LINE) _Atomic uint32_t head; // Advanced by the reader.
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail; // Advanced by the writer.
+    _Atomic uint32_t sleeping;                  // RING_ASLEEP if the reader needs a wakeup.
+    _Alignas(CACHE_LINE) char data[RING_SIZE];
+} ring_half_t;
+
+// Memory segment shared by the server and the client.
+typedef struct ring_shared_t {
+    ring_half_t to_server;
+    ring_half_t to_client;
+} ring_shared_t;
+
+// Connection as seen by one side, shared is NULL if it isn't used.
+typedef struct ring_t {
+    ring_shared_t *shared;
+    ring_half_t *in;
+    ring_half_t *out;
+    int memfd;
+    int socket_fd;
+} ring_t;
+
+int ring_create(ring_t *ring, int socket_fd);
+bool ring_map(ring_t *ring, int memfd, int socket_fd, bool server_side);
+bool ring_join(ring_t *ring, int socket_fd);
+void ring_free(ring_t *ring);
+bool ring_write(ring_t *ring, void const *data, size_t len);
+bool ring_writev(ring_t *ring, struct iovec const *iov, int iovcnt);
+ssize_t ring_fill(ring_t *ring, frame_buf_t *frame);
+void ring_wait(ring_t *ring, int64_t spin_ns);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+
+#include "common.h"
+#include "rules.h"
+
+// Converts card number to proper array index.
+int numtoi(char num) {
+    if (num == '1') {
+        return 8;
+    } else if (num == 'J') {
+        return 9;
+    } else if (num == 'Q') {
+        return 10;
+    } else if (num == 'K') {
+        return 11;
+    } else if (num == 'A') {
+        return 12;
+    } else {
+        return num - '0' - 2;
+    }
+}
+
+// Function to determine which card takes the trick. Returns its position.
+int trick_winner(card_t const *trick, int count) {
+    int winner = 0;
+    for (int i = 1; i < count; i++) {
+        if (trick[i].col == trick[0].col && 
+            numtoi(trick[i].num) > numtoi(trick[winner].num)) {
+            winner = i;
+        }
+    }
+    return winner;
+}
+
+// Function to count points for taking the trick (trick_num counted from 0).
+int trick_points(char game_type, card_t const *trick, int trick_num) {
+    int points = 0;
+    if (game_type == '1' || game_type == '7') {
+        points += 1;
+    } if (game_type == '2' || game_type == '7') {
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            if (trick[i].col == 'H') {
+                points += 1;
+            }
+        }
+    } if (game_type == '3' || game_type == '7') {
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            if (trick[i].num == 'Q') {
+                points += 5;
+            }
+        }
+    } if (game_type == '4' || game_type == '7') {
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            if (trick[i].num == 'J' || trick[i].num == 'K') {
+                points += 2;
+            }
+        }
+    } if (game_type == '5' || game_type == '7') {
+        for (int i = 0; i < NO_PLAYERS; i++) {
+            if (trick[i].col == 'H' && trick[i].num == 'K') {
+                points += 18;
+            }
+        }
+    } if (game_type == '6' || game_type == '7') {
+        if (trick_num == 6 || trick_num == 12) {
+            points += 10;
+        }
+    }
+    return points;
+}
+
+// Function to check if the card from hand may be put on the trick. The
+// player has to follow the color of the first card if possible.
+bool is_legal_card(card_t const *hand, int card_id, card_t const *laid, int laid_count) {
+    if (card_id < 0 || card_id >= NO_CARDS || hand[card_id].num == 0) {
+        return false;
+    }
+    if (laid_count == 0 || hand[card_id].col == laid[0].col) {
+        return true;
+    }
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (hand[i].num != 0 && hand[i].col == laid[0].col) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef MIM_RULES_H
+#define MIM_RULES_H
+
+#include <stdbool.h>
+
+#include "common.h"
+
+int numtoi(char num);
+int trick_winner(card_t const *trick, int count);
+int trick_points(char game_type, card_t const *trick, int trick_num);
+bool is_legal_card(card_t const *hand, int card_id, card_t const *laid, int laid_count);
+
+#endif
@@ -0,0 +1,127 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common.h"
+#include "deal.h"
+#include "rules.h"
+#include "strategy.h"
+
+// Strategy of the automatic client: play the lowest card when leading, the
+// highest card that still loses the trick when following and the highest
+// card otherwise.
+static int pick_duck(card_t const *hand, card_t const *laid, int laid_count, 
+                     uint64_t *rng) {
+    (void) rng;
+    int card_id = -1;
+    if (laid_count == 0) { // No cards in the trick. We pick lowest possible card.
+        for (int i = 0; i < NO_CARDS; i++) {
+            if (hand[i].num == 0) {
+                continue;
+            } else if (card_id == -1 || numtoi(hand[i].num) < numtoi(hand[card_id].num)) {
+                card_id = i;
+            }
+        }
+        return card_id;
+    }
+
+    // Find the highest card in the trick.
+    card_t highest_card = laid[0];
+    for (int i = 1; i < laid_count; i++) {
+        if (highest_card.col == laid[i].col && 
+            numtoi(laid[i].num) > numtoi(highest_card.num)) {
+            highest_card = laid[i];
+        }
+    }
+
+    // We have to follow the color of the first card if we can.
+    bool has_color = false;
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (hand[i].num != 0 && hand[i].col == laid[0].col) {
+            has_color = true;
+        }
+    }
+
+    // Check if we can play lower card.
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (hand[i].num == 0 || hand[i].col != highest_card.col || 
+            numtoi(hand[i].num) > numtoi(highest_card.num)) {
+            continue;
+        } else if (card_id == -1 || numtoi(hand[i].num) > numtoi(hand[card_id].num)) {
+            card_id = i;
+        }
+    }
+    if (card_id == -1) {
+        // If we can't play lower card, we play the highest card.
+        for (int i = 0; i < NO_CARDS; i++) {
+            if (hand[i].num == 0 || (has_color && hand[i].col != laid[0].col)) {
+                continue;
+            } else if (card_id == -1 || numtoi(hand[i].num) > numtoi(hand[card_id].num)) {
+                card_id = i;
+            }
+        }
+    }
+    return card_id;
+}
+
+// Plays the lowest legal card.
+static int pick_low(card_t const *hand, card_t const *laid, int laid_count, 
+                    uint64_t *rng) {
+    (void) rng;
+    int card_id = -1;
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (is_legal_card(hand, i, laid, laid_count) && 
+            (card_id == -1 || numtoi(hand[i].num) < numtoi(hand[card_id].num))) {
+            card_id = i;
+        }
+    }
+    return card_id;
+}
+
+// Plays the highest legal card.
+static int pick_high(card_t const *hand, card_t const *laid, int laid_count, 
+                     uint64_t *rng) {
+    (void) rng;
+    int card_id = -1;
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (is_legal_card(hand, i, laid, laid_count) && 
+            (card_id == -1 || numtoi(hand[i].num) > numtoi(hand[card_id].num))) {
+            card_id = i;
+        }
+    }
+    return card_id;
+}
+
+// Plays a random legal card.
+static int pick_random(card_t const *hand, card_t const *laid, int laid_count, 
+                       uint64_t *rng) {
+    int legal[NO_CARDS];
+    int no_legal = 0;
+    for (int i = 0; i < NO_CARDS; i++) {
+        if (is_legal_card(hand, i, laid, laid_count)) {
+            legal[no_legal++] = i;
+        }
+    }
+    if (no_legal == 0) {
+        return -1;
+    }
+    return legal[next_random(rng) % (uint64_t) no_legal];
+}
+
+// List of known strategies, terminated with an empty entry.
+strategy_t const strategies[] = {
+    {"duck", pick_duck},
+    {"low", pick_low},
+    {"high", pick_high},
+    {"random", pick_random},
+    {NULL, NULL},
+};
+
+strategy_t const *find_strategy(char const *name) {
+    for (int i = 0; strategies[i].name != NULL; i++) {
+        if (strcmp(strategies[i].name, name) == 0) {
+            return &strategies[i];
+        }
+    }
+    return NULL;
+}
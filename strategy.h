@@ -0,0 +1,22 @@
+#ifndef MIM_STRATEGY_H
+#define MIM_STRATEGY_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+// Picks a card from hand to put on the laid cards. Returns index of the
+// card in hand; rng is the state of the player's random generator.
+typedef int (*strategy_fn)(card_t const *hand, card_t const *laid, int laid_count, 
+    uint64_t *rng);
+
+typedef struct strategy_t {
+    char const *name;
+    strategy_fn pick;
+} strategy_t;
+
+extern strategy_t const strategies[];
+
+strategy_t const *find_strategy(char const *name);
+
+#endif